@@ -33,14 +33,21 @@
 #ifndef _PXCHANNEL_H_
 #define _PXCHANNEL_H_
 
+#include "PXPattern.h"
+#include "PXSlotMap.h"
 #include <sys/times.h>
-#include <list>
+#include <vector>
 #include <string>
 #include <memory>
 
 namespace ParEx
 {
 
+class PXHandler;
+
+// opaque channel id, a handle into the driver's channel table
+typedef PXSlotMap<size_t>::handle_t channel_id_t;
+
 typedef struct timeval timeval_t;
 
 static inline bool operator < (const timeval_t &a, const timeval_t &b)
@@ -67,7 +74,7 @@ static inline timeval_t &operator += (timeval_t &a, const timeval_t &b)
 {
   a.tv_sec += b.tv_sec;
   a.tv_usec += b.tv_usec;
-  while (a.tv_usec > 1000000)
+  while (a.tv_usec >= 1000000)
   {
     ++a.tv_sec;
     a.tv_usec -= 1000000;
@@ -76,72 +83,317 @@ static inline timeval_t &operator += (timeval_t &a, const timeval_t &b)
 }
 
 
+// An expectation is either a pattern to look for, or (with no pattern) a
+// period of silence on the channel
 class expectation_t
 {
   public:
-    std::string expr;
+    std::shared_ptr<PXPattern> pattern;
+    timeval_t idle;
     timeval_t timeout;
     timeval_t expiry;
-    void *compiled_regex;
+    size_t step; // where a running PXProgram continues on a match
+    PXHandler *handler; // overrides the channel's handler, not owned
 
     expectation_t ()
-      : expr (), timeout (), expiry (), compiled_regex (NULL) {}
-    expectation_t (const std::string &e, timeval_t t, timeval_t l, void *p)
-      : expr (e), timeout (t), expiry (l), compiled_regex (p) {}
+      : pattern (), idle (), timeout (), expiry (), step (NO_STEP),
+        handler (NULL) {}
+    expectation_t (std::shared_ptr<PXPattern> p, timeval_t t, timeval_t l)
+      : pattern (p), idle (), timeout (t), expiry (l), step (NO_STEP),
+        handler (NULL) {}
+    expectation_t (timeval_t i, timeval_t t, timeval_t l)
+      : pattern (), idle (i), timeout (t), expiry (l), step (NO_STEP),
+        handler (NULL) {}
     expectation_t (const expectation_t &b)
-      : expr (b.expr), timeout (b.timeout), expiry (b.expiry),
-        compiled_regex (b.compiled_regex) {}
+      : pattern (b.pattern), idle (b.idle), timeout (b.timeout),
+        expiry (b.expiry), step (b.step), handler (b.handler) {}
+    expectation_t (expectation_t &&b)
+      : pattern (), idle (b.idle), timeout (b.timeout), expiry (b.expiry),
+        step (b.step), handler (b.handler) { pattern.swap (b.pattern); }
     expectation_t &operator = (const expectation_t &b)
     {
       expectation_t tmp (b);
       tmp.swap (*this);
       return *this;
     }
+    expectation_t &operator = (expectation_t &&b)
+    {
+      return swap (b);
+    }
     expectation_t &swap (expectation_t &b)
     {
-      expr.swap (b.expr);
+      pattern.swap (b.pattern);
+      std::swap (idle, b.idle);
       std::swap (timeout, b.timeout);
       std::swap (expiry, b.expiry);
-      std::swap (compiled_regex, b.compiled_regex);
+      std::swap (step, b.step);
+      std::swap (handler, b.handler);
       return *this;
     }
+
+    static const size_t NO_STEP = static_cast<size_t> (-1);
+
+    bool is_idle () const { return !pattern; }
+
+    // the earliest the channel can count as idle, given its last activity
+    timeval_t idle_deadline (const timeval_t &last_rx) const;
+
+    // human readable description, for printers
+    std::string what () const;
 };
 
 
-typedef std::list<expectation_t> expect_list_t;
+typedef std::vector<expectation_t> expect_list_t;
+
+// A channel's expectations, as groups of serial expectations which are
+// looked for in parallel. Groups are pooled, so once a channel has seen
+// its largest set of expectations, setting them up and tearing them down
+// no longer touches the heap. clear () is O(1); dead groups are only
+// emptied when they're handed out again.
+class PXExpectPool
+{
+  public:
+    typedef std::vector<expect_list_t>::iterator iterator;
+    typedef std::vector<expect_list_t>::const_iterator const_iterator;
+
+    PXExpectPool () : groups_ (), live_ (0) {}
 
-typedef std::list<expect_list_t> expect_groups_t;
+    iterator begin () { return groups_.begin (); }
+    iterator end () { return groups_.begin () + static_cast<ptrdiff_t> (live_); }
+    const_iterator begin () const { return groups_.begin (); }
+    const_iterator end () const { return groups_.begin () + static_cast<ptrdiff_t> (live_); }
+    bool empty () const { return live_ == 0; }
+    expect_list_t &back () { return groups_[live_ - 1]; }
+
+    // a new, empty group at the end
+    expect_list_t &add ()
+    {
+      if (live_ == groups_.size ())
+        groups_.push_back (expect_list_t ());
+      expect_list_t &g = groups_[live_++];
+      g.clear ();
+      return g;
+    }
+    void clear () { live_ = 0; }
+
+  private:
+    std::vector<expect_list_t> groups_;
+    size_t live_;
+};
+
+typedef PXExpectPool expect_groups_t;
 
 typedef enum { PXSERIAL, PXPARALLEL } exp_type_t;
 
+typedef std::vector<std::shared_ptr<PXPattern> > pattern_list_t;
+
 class PXDriver;
 class PXIO;
+class PXDemux;
+class PXFilter;
+class PXProgram;
 
-class PXChannel
+class PXChannel : public std::enable_shared_from_this<PXChannel>
 {
   public:
     PXChannel (std::shared_ptr<PXIO> io, const std::string &name);
 
-    void add_expect (const std::string &expr, timeval_t timeout, exp_type_t et);
+    // The optional handler gets this expectation's match/timeout events
+    // instead of the channel's handler; it must outlive the expectation.
+    void add_expect (const std::string &expr, timeval_t timeout, exp_type_t et, PXHandler *handler = NULL);
+    void add_expect (std::shared_ptr<PXPattern> pattern, timeval_t timeout, const timeval_t &expiry, exp_type_t et, PXHandler *handler = NULL);
+    // Handlers of the expectations cleared are told through on_cancel ()
     void clear_expects ();
 
+    // Expect the channel to produce no output for the given period, counted
+    // from the later of its last output and when the expectation was added
+    void add_idle_expect (timeval_t idle, timeval_t timeout, exp_type_t et, PXHandler *handler = NULL);
+
+    // Abort patterns fail all expectations on the channel as soon as they
+    // are seen, e.g. "Kernel panic", rather than waiting for the timeout
+    void add_abort (const std::string &expr);
+    void clear_aborts ();
+
     void write (const std::string &str);
 
+    // Run an expect/send program on the channel. It replaces any existing
+    // expectations, and the channel counts as matched once it is done.
+    void run (std::shared_ptr<PXProgram> prog);
+    bool running () const { return prog_ != NULL; }
+
+    // Pace writes for consoles which drop input if fed too quickly. The
+    // char delay is the minimum gap between bytes, the line delay is an extra
+    // gap after each line ending. Paced data is queued and fed out by the
+    // driver while it waits, so other channels are not held up.
+    void set_pacing (timeval_t char_delay, timeval_t line_delay);
+    void set_pacing_rate (unsigned bytes_per_sec);
+
+    // Scheduling. The driver takes at most read_budget bytes (up to 4k) from
+    // the device each time round, so a channel flooding output can't hold up
+    // the others, and looks at channels with a higher priority first.
+    void set_read_budget (size_t bytes) { read_budget_ = bytes ? bytes : 1; }
+    void set_priority (int priority) { priority_ = priority; }
+
+    // Event callbacks for the reactor style PXDriver::run ()
+    void set_handler (std::shared_ptr<PXHandler> handler) { handler_ = handler; }
+
+    // In line mode, patterns are only tried when a line ends, and only
+    // against lines they haven't been tried on yet, so a match has to start
+    // in a new line. An unfinished line, e.g. a prompt, is tried once the
+    // channel has been quiet for tail_idle.
+    void set_line_mode (bool on, timeval_t tail_idle);
+
+    // Filter input before it reaches the match buffer, e.g. PXAnsiFilter
+    void set_filter (std::shared_ptr<PXFilter> filter) { filter_ = filter; }
+
+    // Split the channel's output into sub-channels, see PXDemux
+    void set_demux (std::shared_ptr<PXDemux> demux) { demux_ = demux; }
+
+    // Reopen the underlying io, e.g. after an EOF
+    void reopen ();
+    bool eof () const { return eof_; }
+
     const std::string &name () const { return name_; }
     const std::string &last_match () const { return last_match_; }
 
+    // Named capture groups, (?<name>...), of the last match, as offset and
+    // length within last_match (). They are only good until the channel
+    // matches again. False if there's no such group, or it wasn't part of
+    // the match.
+    bool capture (const std::string &name, size_t *offset, size_t *length) const;
+    const std::string &last_abort () const { return last_abort_; }
+
+    // as handed out by the PXDriver the channel was last added to, or 0
+    channel_id_t id () const { return id_; }
+
     // exception class for signalling a bad regex
-    typedef struct {} E_REGEX;
+    typedef PXPattern::E_REGEX E_REGEX;
   private:
+    PXChannel (const PXChannel &);
+    PXChannel &operator = (const PXChannel &);
+
     friend class PXDriver;
 
-    bool expectation_met ();
+    // M_STEPPED is a match which only moved a running program along
+    typedef enum { M_NONE, M_MATCHED, M_ABORTED, M_STEPPED } match_t;
+
+    // What expectation_met () finds in the buffer, before anything is acted
+    // on. Looking is const, so the driver's match workers can do it for many
+    // channels at once, leaving commit () to the driver's own thread.
+    class scan_t
+    {
+      public:
+        scan_t () : found (false), group (0), exp (0), start (0), end (0),
+          abort_start (std::string::npos), abort_end (0), lines_end (0),
+          tail (false), groups () {}
+
+        bool hit () const { return found || abort_start != std::string::npos; }
+
+        bool found;
+        size_t group, exp; // the expectation, within exps_
+        size_t start, end;
+        size_t abort_start, abort_end;
+        size_t lines_end;  // line mode: where the complete lines end
+        bool tail;         // line mode: the unfinished line was tried
+        PXPattern::group_list_t groups;
+    };
+    match_t expectation_met (const pattern_list_t &global_aborts, scan_t &scratch);
+    void scan (const pattern_list_t &global_aborts, scan_t &s) const;
+    match_t commit (scan_t &s);
+    match_t exec_program ();
+    match_t program_timeout ();
+    bool find_abort (const pattern_list_t &aborts, size_t from, size_t to, size_t *start, size_t *end) const;
+    void push_expect (expectation_t &&exp, exp_type_t et);
+
+    // Expectations going without being met themselves, e.g. as another
+    // completed first, take their handlers onto dropped_. Those are then told,
+    // bar the one which got the event, once that has been dispatched.
+    void drop_expects ();
+    void notify_dropped (PXHandler *told, bool aborted);
+    bool next_idle (timeval_t *when) const;
+    void feed (const char *data, size_t len, const timeval_t &now);
+    PXHandler *match_handler () const;
+
+    bool paced () const;
+    bool write_pending () const { return out_ && out_->outq_pos < out_->outq.size (); }
+    bool async_write_pending () const { return out_ && (!out_->wq.empty () || out_->write_token); }
+    void service_writes (const timeval_t &now);
+
+    // lets the owning driver know that what it polls for has changed
+    void changed ();
+
+    // Output state. Most channels are neither paced nor write through
+    // io_uring, so it is only allocated by the first channel which is.
+    class output_t
+    {
+      public:
+        output_t () : pace_char (), pace_line (), outq (), outq_pos (0),
+          next_write (), wq (), inflight (), write_token (0), wait_fd (-1) {}
+
+        timeval_t pace_char;
+        timeval_t pace_line;
+        std::string outq;
+        std::string::size_type outq_pos;
+        timeval_t next_write;
+
+        // io_uring engine, see PXDriver::use_uring ()
+        std::string wq;       // written, not yet submitted
+        std::string inflight; // submitted, not yet completed
+        uint64_t write_token;
+
+        // see PXIO::output_wait_fd (), as registered with the driver
+        int wait_fd;
+    };
+    output_t &output ();
 
     std::shared_ptr<PXIO> io_;
+    channel_id_t id_;
+    PXDriver *owner_;
     expect_groups_t exps_;
     std::string name_;
     std::string buffer_;
     std::string last_match_;
+    std::shared_ptr<PXPattern> last_pattern_;
+    PXPattern::group_list_t groups_;  // of last_match_
+    pattern_list_t aborts_;
+    std::string last_abort_;
+    timeval_t last_rx_;
+    unsigned idle_exps_;
+    std::shared_ptr<PXProgram> prog_;
+    size_t pc_;
+    std::shared_ptr<PXHandler> handler_;
+    PXHandler *last_handler_;
+    std::shared_ptr<PXDemux> demux_;
+    std::shared_ptr<PXFilter> filter_;
+    bool line_mode_;
+    timeval_t tail_idle_;
+    size_t scanned_;     // line mode: buffer_ before this has been tried
+    bool tail_checked_;  // line mode: the unfinished line has been tried
+    bool eof_;
+    bool dirty_; // new expectations, aborts or io since the driver last looked
+    bool writing_; // on the driver's list of channels with output to see to
+    int polled_fd_; // as registered with the driver's epoll set
+    size_t read_budget_;
+    int priority_;
+
+    // io_uring engine state, see PXDriver::use_uring ()
+    bool async_writes_;
+    uint64_t read_token_;
+    int read_fd_;
+
+    std::unique_ptr<output_t> out_;
+
+    // progress within a PXDriver::wait_for_n ()
+    typedef enum { Q_NONE, Q_PENDING, Q_DONE, Q_FAILED } quorum_state_t;
+    quorum_state_t quorum_;
+
+    // precheck_ was filled in by the driver's match workers and is yet to
+    // be committed; anything changing the channel meanwhile clears the flag.
+    // Only channels ever looked at by the workers have one.
+    bool prechecked_;
+    std::unique_ptr<scan_t> precheck_;
+
+    std::vector<PXHandler *> dropped_;
 };
 
 
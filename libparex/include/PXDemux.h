@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXDEMUX_H_
+#define _PXDEMUX_H_
+
+#include "PXIO.h"
+#include "PXPattern.h"
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace ParEx
+{
+
+class PXChannel;
+
+// Splits the output of one channel into several, e.g. the logs of
+// several cores sharing a UART. In line mode, the prefix at the start of
+// each line picks the channel for that line, and is stripped off. In
+// framed mode, a frame byte followed by a channel byte sends all
+// following output to that channel. Anything not routed stays on the
+// channel the demux is attached to. Each byte is looked at once on its
+// way through; the data is never rescanned.
+//
+// The sub-channels come from add_route (), and are added to the driver
+// like any other. They have their own buffers and expectations, and
+// writes to them go to the shared device.
+class PXDemux
+{
+  public:
+    // Line mode. A line is held back until its prefix is known, i.e. a
+    // route matches, or no route can match any more, or the line ends, or
+    // max_prefix bytes have arrived.
+    explicit PXDemux (std::shared_ptr<PXIO> io);
+    // Framed mode
+    PXDemux (std::shared_ptr<PXIO> io, char frame);
+
+    // Line mode; the prefix only counts at the start of the line, so
+    // anchor it with ^ to save the regex looking any further
+    std::shared_ptr<PXChannel> add_route (const std::string &prefix_expr, const std::string &name);
+    // Framed mode
+    std::shared_ptr<PXChannel> add_route (char id, const std::string &name);
+
+    static const size_t max_prefix = 64;
+
+    // exception class for signalling a route of the wrong kind
+    typedef struct {} E_MODE;
+
+  private:
+    PXDemux (const PXDemux &);
+    PXDemux &operator = (const PXDemux &);
+
+    friend class PXDriver;
+
+    // Hands each run of data to out (sub-channel, data, len), with a NULL
+    // sub-channel for data which isn't routed anywhere
+    template<typename F> void split (const char *data, size_t len, F out);
+    template<typename F> void route_head (bool complete, F out);
+    PXChannel *find_route (char id) const;
+
+    typedef struct
+    {
+      std::shared_ptr<PXPattern> prefix;
+      char id;
+      std::shared_ptr<PXChannel> chan;
+    } route_t;
+
+    std::shared_ptr<PXIO> io_;
+    const bool framed_;
+    const char frame_;
+    std::vector<route_t> routes_;
+
+    PXChannel *cur_;  // where the current line or frame goes
+    bool at_start_;   // line mode: cur_ not known yet, collecting head_
+    bool want_id_;    // framed mode: the next byte picks the channel
+    std::string head_;
+};
+
+
+// A demuxed sub-channel's device. It has nothing to poll, as the data is
+// handed over by the demux, and writes go to the shared device.
+class PXDemuxIO : public PXIO
+{
+  public:
+    explicit PXDemuxIO (std::shared_ptr<PXIO> io);
+
+    virtual ssize_t read (char *buf, size_t len);
+    virtual void putc (char c) { io_->putc (c); }
+    virtual void reopen ();
+
+    virtual int write_fd () { return -1; }
+    virtual bool output_pending () const { return io_->output_pending (); }
+    virtual void flush () { io_->flush (); }
+
+  private:
+    std::shared_ptr<PXIO> io_;
+};
+
+
+template<typename F>
+void
+PXDemux::split (const char *data, size_t len, F out)
+{
+  const char mark = framed_ ? frame_ : '\n';
+  size_t i = 0;
+  while (i < len)
+  {
+    if (want_id_)
+    {
+      cur_ = find_route (data[i++]);
+      want_id_ = false;
+      continue;
+    }
+    if (at_start_)
+    {
+      size_t room = std::min (max_prefix - head_.size (), len - i);
+      const void *nl = memchr (data + i, '\n', room);
+      size_t take = nl ? static_cast<size_t> (static_cast<const char *> (nl) - (data + i)) + 1 : room;
+      head_.append (data + i, take);
+      i += take;
+      route_head (nl || head_.size () == max_prefix, out);
+      continue;
+    }
+
+    const void *m = memchr (data + i, mark, len - i);
+    size_t take = m ? static_cast<size_t> (static_cast<const char *> (m) - (data + i)) : len - i;
+    if (m && !framed_)
+      ++take; // the newline belongs to the line
+    if (take)
+      out (cur_, data + i, take);
+    i += take;
+    if (m && framed_)
+    {
+      want_id_ = true;
+      ++i;
+    }
+    else if (m)
+      at_start_ = true;
+  }
+}
+
+
+template<typename F>
+void
+PXDemux::route_head (bool complete, F out)
+{
+  for (auto r = routes_.begin (); r != routes_.end (); ++r)
+  {
+    size_t start, end;
+    if (r->prefix->match (head_, &start, &end) && start == 0)
+    {
+      cur_ = r->chan.get ();
+      at_start_ = false;
+      if (end < head_.size ())
+        out (cur_, head_.data () + end, head_.size () - end);
+      break;
+    }
+  }
+  // a prompt with no newline after it mustn't wait for one to be let out
+  if (at_start_ && !complete)
+  {
+    complete = true;
+    for (auto r = routes_.begin (); complete && r != routes_.end (); ++r)
+      complete = !r->prefix->could_match (head_);
+  }
+  if (at_start_ && complete)
+  {
+    cur_ = NULL;
+    at_start_ = false;
+    out (cur_, head_.data (), head_.size ());
+  }
+  if (!at_start_)
+  {
+    if (head_[head_.size () -1] == '\n')
+      at_start_ = true; // the whole line was in the head
+    head_.clear ();
+  }
+}
+
+} // namespace 
+#endif
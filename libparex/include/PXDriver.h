@@ -34,25 +34,38 @@
 #define _PXDRIVER_H_
 
 #include "PXChannel.h"
+#include "PXQueue.h"
+#include "PXHistogram.h"
+#include "PXUring.h"
+#include "PXWorkers.h"
+#include <atomic>
 #include <memory>
 #include <utility>
 #include <vector>
+#include <map>
+#include <set>
+#include <string>
 #include <cstdint>
-#include <sys/select.h>
+#include <sys/time.h>
+
+struct epoll_event;
 
 namespace ParEx
 {
 
-// opaque channel id
-typedef uintptr_t channel_id_t;
-
 class PXPrinter;
 
 class PXDriver
 {
   public:
+    // The printer is this driver's alone, see PXPrinter
     explicit PXDriver (std::shared_ptr<PXPrinter> printer);
+    ~PXDriver ();
 
+    // Memory budget: an idle channel, one with nothing buffered, queued or
+    // expected, costs under 600 bytes of heap on 64-bit Linux, counting its
+    // share of the driver's and the printer's tables but not its device.
+    // A channel is in one driver at a time, which gives it its id.
     channel_id_t add_channel (std::shared_ptr<PXChannel> chan);
     void         remove_channel (channel_id_t chan_id);
 
@@ -60,22 +73,244 @@ class PXDriver
     void         wait_for_one (channel_id_t chan_id);
     channel_id_t wait_for_any ();
 
-    // Exception type for the waitXxx functions
+    typedef std::vector<channel_id_t> channel_id_list_t;
+    typedef struct {
+      bool reached;              // n matched, otherwise it timed out
+      channel_id_list_t matched; // all expectations met
+      channel_id_list_t pending; // still waiting, or timed out
+    } quorum_t;
+
+    // Wait until at least n of the given channels have had all their
+    // expectations met. Channels in the set which time out or abort are
+    // dropped from the wait, which ends once n can no longer be reached;
+    // rather than throwing TIMEOUT, that returns with reached false, so
+    // the lists are not lost. Channels outside the set are left alone,
+    // timeouts and all, for a later wait to report.
+    quorum_t     wait_for_n (const channel_id_list_t &chan_ids, size_t n);
+    quorum_t     wait_for_group (const std::string &group, size_t n);
+
+    // Abort patterns applied to every channel, in addition to their own
+    void         add_abort (const std::string &expr);
+    void         clear_aborts ();
+
+    // Block until all paced writes have been fed out
+    void         drain_writes ();
+
+    // Reactor style event loop. Matches, aborts, timeouts, EOFs and received
+    // data are dispatched to the channels' PXHandlers (see PXChannel::
+    // set_handler) instead of being thrown. Expectations which time out are
+    // cleared. run_once returns after the first round of dispatched events,
+    // or when the timeout passes, with the number of events; run keeps going
+    // for as long as there are expectations or paced writes outstanding.
+    // Both return -1 and set errno on failure.
+    int          run_once (timeval_t timeout);
+    int          run ();
+
+    // Embedding in an external event loop. event_fd returns an epoll fd
+    // which becomes readable when any channel has data; the host should call
+    // process_events whenever it does, and no later than next_deadline. A
+    // channel which has been reopened is picked up by the next
+    // process_events. process_events never blocks, and returns the number of
+    // events dispatched, or -1 with errno set.
+    int          event_fd ();
+    bool         next_deadline (timeval_t *when) const;
+    int          process_events ();
+
+    // Named channel groups. Broadcasts share the payload, compile the
+    // pattern once and use a single expiry across the whole group.
+    void         group_add (const std::string &group, channel_id_t chan_id);
+    void         group_remove (const std::string &group, channel_id_t chan_id);
+    void         group_clear (const std::string &group);
+    size_t       group_size (const std::string &group);
+    void         broadcast_write (const std::string &group, const std::string &str);
+    void         broadcast_expect (const std::string &group, const std::string &expr, timeval_t timeout, exp_type_t et);
+    void         broadcast_run (const std::string &group, std::shared_ptr<PXProgram> prog);
+
+    // Thread-safe versions of the above, for use from threads other than
+    // the one running the driver. They are put on a lock-free queue, and
+    // carried out by the driver thread the next time it polls; a blocked
+    // wait is woken up for them. Patterns are compiled, and expiry times
+    // taken, by the posting thread. Only handing out a new channel id, and
+    // looking up an interned pattern, briefly take a lock.
+    channel_id_t post_add_channel (std::shared_ptr<PXChannel> chan);
+    void         post_remove_channel (channel_id_t chan_id);
+    void         post_write (channel_id_t chan_id, const std::string &str);
+    void         post_expect (channel_id_t chan_id, const std::string &expr, timeval_t timeout, exp_type_t et);
+
+    // Low latency mode. Before going to sleep in epoll_wait (), or waiting
+    // on the io_uring completion queue, the driver keeps polling its
+    // channels without blocking for up to spin; a zero spin turns it off
+    // again. pin_to_cpu pins the calling thread, which
+    // should be the one running the driver, and returns -1 with errno set
+    // on failure.
+    void         set_busy_poll (timeval_t spin);
+    static int   pin_to_cpu (int cpu);
+
+    // Switches the blocking waits, run () and process_events () over to
+    // io_uring: reads are kept armed as multishot reads into a shared pool
+    // of buffers, unpaced writes are batched into the same submissions, and
+    // the next deadline is a uring timeout, so a single syscall covers all
+    // channels. Returns false, leaving epoll in use, if io_uring is not
+    // available. There is no going back once enabled.
+    bool         use_uring ();
+
+    // Parallel matching. When at least min_batch channels with
+    // expectations are waiting to be checked at once, e.g. after a burst of
+    // output from many devices, their regexes are run on a pool of that
+    // many worker threads plus the driver thread. Each channel is checked
+    // by one thread only, and the results are still handed out one at a
+    // time in channel order. Reads, writes and handlers stay on the driver
+    // thread, so channels running programs, which may write as they step,
+    // are always checked there. Zero workers, the default, turns it off.
+    void         set_match_workers (unsigned workers, size_t min_batch = 32);
+
+    // Measured latencies: from reading the data which completed a match to
+    // dispatching it, and how late the driver woke up for a timeout or
+    // paced write.
+    const PXHistogram &match_latency () const { return match_latency_; }
+    const PXHistogram &wake_latency () const { return wake_latency_; }
+    void         reset_latency ();
+
+    // Exception types for the waitXxx functions
     typedef struct {} TIMEOUT;
+    typedef struct { channel_id_t chan_id; } ABORTED;
+
+    // Exception type for operations on an unknown group
+    typedef struct {} E_NO_GROUP;
 
     typedef std::vector<std::shared_ptr<PXChannel> > channel_list_t;
 
   private:
+    friend class PXChannel;
+
+    void insert_channel (std::shared_ptr<PXChannel> chan, channel_id_t chan_id);
+    void refresh (PXChannel &chan);
+    void writing (PXChannel &chan);
+    void refresh_fds ();
+    std::shared_ptr<PXChannel> find_channel (channel_id_t chan_id) const;
+
+    class group_t
+    {
+      public:
+        group_t () : members (), ids () {}
+
+        channel_list_t members;     // in the order they were added
+        std::set<channel_id_t> ids; // of the members, for finding them
+    };
+    typedef std::map<std::string, group_t> group_map_t;
+    channel_list_t &find_group (const std::string &group);
+    void group_remove (group_t &g, channel_id_t chan_id);
+
     bool have_expectations () const;
 
-    typedef std::pair<PXChannel *, expectation_t> expect_handle_t;
-    expect_handle_t next_expect () const;
+    typedef std::pair<std::shared_ptr<PXChannel>, expectation_t> expect_handle_t;
+    expect_handle_t next_expect (bool quorum) const;
+
+    typedef enum { W_MATCHED, W_ABORTED, W_TIMEOUT } wait_t;
+    // with quorum, only channels pending in a wait_for_quorum () can time out
+    wait_t wait_step (channel_id_t *matched, expect_handle_t *expired, bool quorum);
+    void find_idle (const timeval_t &now, timeval_t &wake, channel_list_t &due) const;
+    void throw_aborted (channel_id_t chan_id);
+    quorum_t wait_for_quorum (const channel_list_t &set, size_t n);
+
+    PXChannel::match_t check_expectations (channel_list_t &channels, channel_id_t *matched);
+    void precheck (const channel_list_t &channels);
+    void check_all ();
+    void schedule (channel_list_t &channels) const;
+    void timed_out (std::shared_ptr<PXChannel> chan, const expectation_t &exp);
+    void program_done (std::shared_ptr<PXChannel> chan);
+    void expire (const timeval_t &now, timeval_t &wake);
+    int run_until (const timeval_t &deadline);
 
-    int make_fd_set (const channel_list_t &channels, fd_set &fds) const;
-    bool check_expectations (channel_list_t &channels, channel_id_t *matched);
+    bool writes_pending () const;
+    void service_writes (const timeval_t &now, timeval_t &wake);
+    bool poll_once (const timeval_t &deadline, channel_list_t &ready);
+    bool uring_poll (const timeval_t *wake, timeval_t &now, channel_list_t &ready);
+    void uring_submit (const std::shared_ptr<PXChannel> &chan);
+    void uring_complete (const PXUring::completion_t &c, const timeval_t &now, channel_list_t &ready);
+    void uring_forget (PXChannel &chan);
+    void deliver (const std::shared_ptr<PXChannel> &chan, const char *data, size_t len, const timeval_t &now, channel_list_t &ready);
+    void take (const std::shared_ptr<PXChannel> &chan, const char *data, size_t len, const timeval_t &now, channel_list_t &ready);
+    void channel_eof (const std::shared_ptr<PXChannel> &chan);
+    void dispatch_deferred ();
+    int wait_events (epoll_event *evs, int max, const timeval_t &wake, timeval_t &now);
+    void take_events (const epoll_event *evs, int num, const timeval_t &now, channel_list_t &ready);
+    void read_channel (const std::shared_ptr<PXChannel> &chan, const timeval_t &now, channel_list_t &ready);
+
+    void watch (PXChannel &chan);
+    void unwatch (PXChannel &chan);
+    bool wait_output (PXChannel &chan);
+    void unwait_output (PXChannel &chan);
+    void sync_channels (channel_list_t &dirty);
+    bool read_events (const timeval_t &now, channel_list_t &ready);
+
+    typedef enum { C_ADD, C_REMOVE, C_WRITE, C_EXPECT } command_type_t;
+    typedef struct {
+      command_type_t type;
+      std::shared_ptr<PXChannel> chan; // for C_ADD
+      channel_id_t chan_id;
+      std::string data;
+      std::shared_ptr<PXPattern> pattern;
+      timeval_t timeout, expiry;
+      exp_type_t et;
+    } command_t;
+    void post (command_t &&cmd);
+    bool run_commands (); // whether there were any
+    void drain_wakeup ();
 
     std::shared_ptr<PXPrinter> printer_;
     channel_list_t channels_;
+    PXSlotMap<size_t> slots_; // channel id -> position in channels_
+
+    // What the scans made on every poll need from each channel, in step
+    // with channels_, so they walk a dense array instead of every channel
+    // and its device. Channels keep them up to date through
+    // refresh ().
+    std::vector<timeval_t> expiry_; // of its earliest expectation
+    std::vector<timeval_t> idle_;   // when it's due a check without new data
+    group_map_t groups_;
+    channel_list_t unchecked_;
+    channel_list_t writers_; // with output queued anywhere, until it's all out
+    pattern_list_t aborts_;
+    bool resched_;
+    int events_;
+    size_t rr_; // where the next full scan starts
+    int epfd_;
+    size_t unwatched_;
+    int outfd_; // epoll set of what devices with output pending wait on
+    size_t out_waits_;
+    PXQueue<command_t> commands_;
+    std::atomic<bool> signalled_;
+    int wakefd_; // eventfd, readable once commands_ has been posted to
+    timeval_t spin_;
+    PXHistogram match_latency_, wake_latency_;
+
+    // token kinds, in the bottom bits of the io_uring user data
+    typedef enum { T_READ, T_WRITE, T_TIMEOUT, T_WAKE } token_kind_t;
+    PXUring ring_;
+    uint64_t ring_seq_;
+    std::map<uint64_t, std::shared_ptr<PXChannel> > ring_ops_;
+    channel_list_t unarmed_; // without a read in flight
+    uint64_t ring_timeout_;
+    timeval_t ring_deadline_; // what ring_timeout_ was armed for
+    bool ring_wake_armed_;
+    bool ring_out_armed_;
+    bool multishot_;
+
+    std::unique_ptr<PXWorkers> workers_;
+    size_t min_batch_;
+    std::vector<PXChannel *> batch_;
+    PXChannel::scan_t scan_; // for channels checked on this thread
+
+    // on_data () / on_eof () events, held back until the pass over the
+    // channels is done, as handlers may add or remove channels
+    typedef struct
+    {
+      std::shared_ptr<PXChannel> chan;
+      size_t off, len; // within deferred_data_, len is npos for an EOF
+    } deferred_t;
+    std::vector<deferred_t> deferred_;
+    std::string deferred_data_;
 };
 
 } // namespace
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXFILTER_H_
+#define _PXFILTER_H_
+
+#include <string>
+#include <cstddef>
+
+namespace ParEx
+{
+
+// An input filter, run once over each chunk of a channel's input before
+// it reaches the match buffer. The printer still gets the raw data.
+// Filters see the stream in arbitrary pieces, so must carry any partial
+// state over to the next call.
+class PXFilter
+{
+  public:
+    virtual ~PXFilter ();
+
+    // Appends the filtered form of data to out
+    virtual void filter (const char *data, size_t len, std::string &out) = 0;
+};
+
+
+// Strips terminal escape sequences (CSI, OSC, DCS and friends) and stray
+// control characters, and turns CR LF, or a bare CR redraw, into LF. Runs
+// of plain text are found 16 bytes at a time and copied in bulk.
+class PXAnsiFilter : public PXFilter
+{
+  public:
+    PXAnsiFilter ();
+
+    virtual void filter (const char *data, size_t len, std::string &out);
+
+  private:
+    typedef enum { S_TEXT, S_CR, S_ESC, S_ESC_INTER, S_CSI, S_STRING, S_STRING_ESC } state_t;
+
+    state_t state_;
+};
+
+} // namespace
+#endif
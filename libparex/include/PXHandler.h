@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXHANDLER_H_
+#define _PXHANDLER_H_
+
+#include "PXDriver.h"
+
+namespace ParEx
+{
+
+// Event callbacks, for use with PXDriver::run () / run_once () instead of (or
+// as well as) the blocking waits. A handler can be set per channel, and
+// overridden per expectation. The default implementations do nothing.
+class PXHandler
+{
+  public:
+    virtual ~PXHandler ();
+
+    virtual void on_match (channel_id_t chan_id, const std::string &str);
+    virtual void on_abort (channel_id_t chan_id, const std::string &str);
+    virtual void on_timeout (channel_id_t chan_id, const expectation_t &exp);
+    // The expectation went unmet without timing out, as the channel's
+    // expectations were cleared, e.g. by another one completing
+    virtual void on_cancel (channel_id_t chan_id);
+    virtual void on_eof (channel_id_t chan_id);
+    virtual void on_data (channel_id_t chan_id, const char *data, size_t len);
+};
+
+} // namespace
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXHISTOGRAM_H_
+#define _PXHISTOGRAM_H_
+
+#include <sys/time.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace ParEx
+{
+
+// Latency histogram with power of two buckets; bucket n counts samples of
+// at least 2^n and less than 2^(n+1) microseconds, bucket 0 also counting 0.
+class PXHistogram
+{
+  public:
+    static const size_t BUCKETS = 32;
+
+    PXHistogram ();
+
+    void add (const struct timeval &latency);
+    void reset ();
+
+    uint64_t count () const { return count_; }
+    uint64_t count (size_t bucket) const { return buckets_[bucket]; }
+    uint64_t max_us () const { return max_us_; }
+    uint64_t mean_us () const { return count_ ? sum_us_ / count_ : 0; }
+
+    // Upper bound in microseconds of the bucket holding the given percentile,
+    // or the largest sample if that is lower
+    uint64_t percentile_us (unsigned pct) const;
+
+  private:
+    uint64_t buckets_[BUCKETS];
+    uint64_t count_, sum_us_, max_us_;
+};
+
+} // namespace
+#endif
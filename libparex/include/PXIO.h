@@ -33,6 +33,8 @@
 #ifndef _PXIO_H_
 #define _PXIO_H_
 
+#include <sys/types.h>
+
 namespace ParEx
 {
 
@@ -45,8 +47,27 @@ class PXIO
     virtual char getc ();
     virtual void putc (char c);
 
+    // Non-throwing bulk read for the driver. Returns the number of bytes
+    // read, 0 on EOF, or -1 with errno set.
+    virtual ssize_t read (char *buf, size_t len);
+
     virtual void reopen () = 0;
 
+    // Devices which queue output themselves report it here, and get
+    // flush ()ed by the driver until it's all gone. If they can name an fd
+    // which becomes ready once flush () can make progress, readable or,
+    // with *writable set, writable, the driver waits on that; otherwise it
+    // retries every millisecond.
+    virtual bool output_pending () const { return false; }
+    virtual void flush () {}
+    virtual int output_wait_fd (bool *) const { return -1; }
+
+    virtual bool is_socket () const { return false; }
+
+    // False if read () has to see the data itself, so the driver may only
+    // poll the fd rather than read it directly
+    virtual bool raw_reads () const { return true; }
+
     // Exception types for getc/putc/reopen
     typedef struct {} E_EOF;
     typedef struct {} E_INTR;
@@ -56,6 +77,10 @@ class PXIO
     // file descriptor for select() use, not necessarily where data comes from
     int select_fd () { return fd_; }
 
+    // where data is written to, for devices with separate in/out fds, or
+    // -1 if it can only go through putc ()
+    virtual int write_fd () { return fd_; }
+
   protected:
     static void close_on_exec (int fd);
 
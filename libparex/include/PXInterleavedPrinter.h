@@ -50,30 +50,39 @@ class PXInterleavedPrinter : public PXPrinter
     
     virtual void out (channel_id_t chan_id, char c);
     virtual void matched (channel_id_t chan_id, const std::string &str);
+    virtual void aborted (channel_id_t chan_id, const std::string &str);
     virtual void timedout (channel_id_t chan_id, const std::string &expr, timeval_t timeout);
 
     virtual void flush ();
 
   protected:
-    virtual std::string line_prefix () const;
-    virtual std::string hilight_match (const std::string &str) const;
-    virtual std::string hilight_timeout (const std::string &str) const;
+    // These work in place, so that the steady flow of output and matches
+    // reuses the same storage instead of allocating
+    virtual void format_prefix (std::string &prefix) const;
+    virtual void mark_match (std::string &buf, size_t pos, size_t len) const;
+    virtual void mark_timeout (std::string &buf, size_t pos, size_t len) const;
+    virtual void mark_abort (std::string &buf, size_t pos, size_t len) const;
 
   private:
     PXInterleavedPrinter (const PXInterleavedPrinter &);
     PXInterleavedPrinter &operator = (const PXInterleavedPrinter &);
 
     typedef struct {
-      channel_id_t chid;
+      channel_id_t chid; // 0 for a free slot
       std::shared_ptr<PXChannel> channel;
       std::string buffer;
     } chan_buf_t;
+    // indexed by the slot of the channel id, see PXSlotMap::index (), which
+    // is why a printer can't be shared between drivers
     typedef std::vector<chan_buf_t> chan_vec_t;
 
     chan_buf_t *find_buf (channel_id_t chid);
+    void flush_buf (chan_buf_t &b);
+    void write_line (const chan_buf_t &b, size_t from, size_t len);
 
     chan_vec_t bufs_;
     FILE *out_;
+    std::string prefix_;
 };
 
 } // namespaec
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXPATTERN_H_
+#define _PXPATTERN_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace ParEx
+{
+
+// A compiled expectation regex. Patterns are immutable once compiled, so a
+// single instance may be shared by any number of expectations and channels.
+class PXPattern
+{
+  public:
+    explicit PXPattern (const std::string &expr);
+    ~PXPattern ();
+
+    // A shared, already compiled instance for expr if there is one, so
+    // scripts repeating the same expectations don't recompile them. The
+    // table is bounded: once it's large, patterns nobody else holds are
+    // dropped.
+    static std::shared_ptr<PXPattern> intern (const std::string &expr);
+
+    const std::string &expr () const { return expr_; }
+
+    // Looks for a match in buf, and if found returns the start/end offsets
+    bool match (const std::string &buf, size_t *start, size_t *end) const;
+    // Same, but only looking at [from, to) of buf
+    bool match (const std::string &buf, size_t from, size_t to, size_t *start, size_t *end) const;
+
+    // Whether buf from its start is a match, or the start of one which
+    // more data could complete
+    bool could_match (const std::string &buf) const;
+
+    // Named groups, (?<name>...), capture as part of the match; unnamed
+    // ones don't. Group n's start/end offsets go to groups[2n-2], [2n-1],
+    // or npos if it took no part in the match.
+    typedef std::vector<size_t> group_list_t;
+    bool match (const std::string &buf, size_t from, size_t to, size_t *start, size_t *end, group_list_t &groups) const;
+    size_t groups () const { return names_.size (); }
+    // Group number for a name, or 0 if there's none
+    size_t group (const std::string &name) const;
+
+    // exception class for signalling a bad regex
+    typedef struct {} E_REGEX;
+
+  private:
+    PXPattern (const PXPattern &);
+    PXPattern &operator = (const PXPattern &);
+
+    std::string expr_;
+    void *re_;
+    std::vector<std::string> names_; // by group number - 1
+};
+
+} // namespace
+#endif
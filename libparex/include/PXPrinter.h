@@ -38,6 +38,10 @@
 namespace ParEx
 {
 
+// Shows the output of a driver's channels. A printer serves the one driver
+// it was given to: channel ids are only unique within a driver, and
+// printers may index their state by them, so two drivers sharing one would
+// mix up their channels.
 class PXPrinter
 {
   public:
@@ -48,6 +52,8 @@ class PXPrinter
 
     virtual void out (channel_id_t chan_id, char c) = 0;
     virtual void matched (channel_id_t chan_id, const std::string &str) = 0;
+    // Printers written before aborts were reported needn't show them
+    virtual void aborted (channel_id_t, const std::string &) {}
     virtual void timedout (channel_id_t chan_id, const std::string &expr, timeval_t timeout) = 0;
 
     virtual void flush () = 0;
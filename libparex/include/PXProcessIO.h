@@ -36,6 +36,7 @@
 #include "PXIO.h"
 #include <string>
 #include <vector>
+#include <memory>
 #include <cstdint>
 #include <unistd.h>
 
@@ -60,5 +61,60 @@ class PXProcessIO : public PXIO
     pid_t child_;
 };
 
+
+// One end of a pipe from a PXPipeIO process, e.g. its stderr when that is
+// kept apart. It follows the process across reopen ()s, and can't be
+// written to. It takes ownership of both fd and log.
+class PXPipeStream : public PXIO
+{
+  public:
+    PXPipeStream (int fd, int log);
+    ~PXPipeStream ();
+
+    virtual ssize_t read (char *buf, size_t len);
+    virtual void putc (char c);
+    virtual void reopen ();
+    virtual bool raw_reads () const { return tee_r_ < 0; }
+
+  private:
+    friend class PXPipeIO;
+    void replace (int fd, int log);
+
+    int log_, tee_r_, tee_w_;
+};
+
+
+// A process talking over pipes instead of a pty, for jobs which don't need
+// a terminal. There's no line discipline in the way, stderr can be kept
+// apart from stdout, and the pipes are enlarged. Given a log file, output
+// is teed and spliced into it without passing through user space.
+class PXPipeIO : public PXIO
+{
+  public:
+    PXPipeIO (const argv_t &cmdline, bool separate_stderr, const std::string &logfile);
+    ~PXPipeIO ();
+
+    virtual ssize_t read (char *buf, size_t len);
+    virtual void putc (char c);
+    virtual int write_fd () { return in_; }
+    virtual void reopen ();
+    virtual bool raw_reads () const { return tee_r_ < 0; }
+
+    // The child's stderr, if kept separate, for a channel of its own
+    std::shared_ptr<PXIO> stderr_io () const { return err_; }
+
+  private:
+    void do_close ();
+    void do_open ();
+
+    const argv_t cmdline_;
+    const bool separate_;
+    const std::string logfile_;
+    pid_t child_;
+    int in_;
+    int log_, tee_r_, tee_w_;
+    std::shared_ptr<PXPipeStream> err_;
+};
+
 } // namespace 
 #endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXPROGRAM_H_
+#define _PXPROGRAM_H_
+
+#include "PXChannel.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace ParEx
+{
+
+// A small expect/send state machine, compiled once and run by the driver as
+// matches arrive, so that e.g. a login sequence needs no round trips to the
+// caller. Programs are immutable and can be shared between channels.
+//
+// The text form has one instruction per line, each optionally preceded by a
+// "label:". Anything after a '#' outside quotes is a comment.
+//
+//   expect <timeout> <regex> [<regex> <label>]... [else <label>]
+//       Wait for the first regex and carry on with the next instruction, or
+//       for any of the others and jump to their label. On timeout jump to
+//       the else label, or fail if there is none.
+//   idle <ms> <timeout> [else <label>]
+//       Wait for the channel to go quiet for the given time.
+//   send <string>
+//   goto <label>
+//   done
+//   fail
+//
+// Arguments may be double quoted. Within quotes the escapes \n, \r, \t,
+// \e, \" and \\ are recognised, while any other backslash is left for the
+// regex engine.
+// Running off the end of the program is the same as "done".
+class PXProgram
+{
+  public:
+    explicit PXProgram (const std::string &text);
+
+    typedef enum { OP_EXPECT, OP_IDLE, OP_SEND, OP_GOTO, OP_DONE, OP_FAIL } op_t;
+
+    typedef struct {
+      std::shared_ptr<PXPattern> pattern;
+      size_t target;
+    } branch_t;
+
+    class step_t
+    {
+      public:
+        step_t ()
+          : op (OP_DONE), branches (), idle (), timeout (),
+            on_timeout (npos), data (), target (npos) {}
+
+        op_t op;
+        std::vector<branch_t> branches; // expect
+        timeval_t idle;                 // idle
+        timeval_t timeout;              // expect, idle
+        size_t on_timeout;              // expect, idle
+        std::string data;               // send
+        size_t target;                  // goto
+    };
+
+    size_t size () const { return steps_.size (); }
+    const step_t &step (size_t pc) const { return steps_.at (pc); }
+
+    static const size_t npos = static_cast<size_t> (-1);
+
+    // exception class for signalling a malformed program
+    typedef struct { size_t line; } E_SYNTAX;
+
+  private:
+    std::vector<step_t> steps_;
+};
+
+} // namespace
+#endif
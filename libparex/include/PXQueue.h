@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXQUEUE_H_
+#define _PXQUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+namespace ParEx
+{
+
+// Unbounded lock-free multi-producer, single-consumer queue. Any number of
+// threads may push concurrently; only one thread may pop. A push which is
+// still in progress can briefly hide the items behind it from pop, so
+// producers need to signal the consumer after pushing.
+template<typename T>
+class PXQueue
+{
+  public:
+    PXQueue () : stub_ (), head_ (&stub_), tail_ (&stub_) {}
+
+    ~PXQueue ()
+    {
+      for (link_t *l = tail_; l; )
+      {
+        link_t *next = l->next.load (std::memory_order_relaxed);
+        release (l);
+        l = next;
+      }
+    }
+
+    void push (T &&item)
+    {
+      node_t *n = new node_t (std::move (item));
+      link_t *prev = head_.exchange (n, std::memory_order_acq_rel);
+      prev->next.store (n, std::memory_order_release);
+    }
+
+    bool pop (T &item)
+    {
+      link_t *next = tail_->next.load (std::memory_order_acquire);
+      if (!next)
+        return false;
+      // the popped node stays behind as the new stub
+      item = std::move (static_cast<node_t *> (next)->item);
+      release (tail_);
+      tail_ = next;
+      return true;
+    }
+
+    bool empty () const
+    {
+      return !tail_->next.load (std::memory_order_acquire);
+    }
+
+  private:
+    PXQueue (const PXQueue &);
+    PXQueue &operator = (const PXQueue &);
+
+    class link_t
+    {
+      public:
+        link_t () : next (nullptr) {}
+
+        std::atomic<link_t *> next;
+    };
+
+    class node_t : public link_t
+    {
+      public:
+        explicit node_t (T &&i) : link_t (), item (std::move (i)) {}
+
+        T item;
+    };
+
+    void release (link_t *l)
+    {
+      if (l != &stub_)
+        delete static_cast<node_t *> (l);
+    }
+
+    link_t stub_;
+    std::atomic<link_t *> head_;  // producers' end
+    alignas (64) link_t *tail_;   // consumer's end
+};
+
+} // namespace
+#endif
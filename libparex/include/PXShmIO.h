@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXSHMIO_H_
+#define _PXSHMIO_H_
+
+#include "PXIO.h"
+#include "PXShmRing.h"
+#include <string>
+#include <cstdint>
+
+namespace ParEx
+{
+
+// Console over a pair of shared-memory rings (see PXShmRing.h), for device
+// simulators on the same host. Traffic takes a single memcpy each way
+// instead of a trip through a pty. The memfd and doorbells are left open
+// across exec, so a simulator started afterwards, e.g. by a PXProcessIO,
+// inherits them and attaches with attach_spec ().
+class PXShmIO : public PXIO
+{
+  public:
+    explicit PXShmIO (uint32_t size = 65536);
+    ~PXShmIO ();
+
+    virtual ssize_t read (char *buf, size_t len);
+    virtual void putc (char c);
+    virtual void reopen ();
+
+    virtual int write_fd () { return -1; }
+    virtual bool raw_reads () const { return false; }
+    virtual bool output_pending () const { return bell_due_ || !pending_.empty (); }
+    virtual void flush ();
+    virtual int output_wait_fd (bool *writable) const;
+
+    // "<memfd>,<rx doorbell>,<tx doorbell>,<tx space doorbell>", for
+    // px_shm_attach ()
+    std::string attach_spec () const;
+
+  private:
+    PXShmIO (const PXShmIO &);
+    PXShmIO &operator= (const PXShmIO &);
+
+    px_shm_header_t *hdr_;
+    size_t map_size_;
+    int memfd_, tx_bell_, space_bell_; // fd_ is the rx doorbell
+    bool bell_due_;
+    std::string pending_; // output which didn't fit in the ring
+};
+
+} // namespace 
+#endif
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared-memory console ring, as used by PXShmIO. This header is plain C
+ * so device simulators can include it without linking against libparex.
+ *
+ * The mapping holds two single-producer/single-consumer byte rings: "rx"
+ * carries device output to parexis, "tx" carries input to the device.
+ * Each direction has an eventfd doorbell which the writer rings after
+ * adding data. The tx ring also has a space doorbell, which the device
+ * rings after taking data if parexis found the ring full and asked for it,
+ * so parexis needn't poll for room. Parexis passes everything to the
+ * simulator as a string "<memfd>,<rx doorbell>,<tx doorbell>,<tx space
+ * doorbell>", normally in an environment variable, with the fds inherited
+ * across exec. Simulator side:
+ *
+ *   px_shm_t shm;
+ *   if (px_shm_attach (getenv ("PAREX_SHM"), &shm) == 0)
+ *   {
+ *     px_shm_send (&shm, "login: ", 7);
+ *     ...poll shm.tx_bell, then px_shm_recv (&shm, buf, sizeof (buf))...
+ *   }
+ */
+
+#ifndef _PXSHMRING_H_
+#define _PXSHMRING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PX_SHM_MAGIC 0x50585332u /* "PXS2" */
+
+/* Indices run freely and wrap at 2^32; sizes are powers of two. Each one
+ * has a cache line to itself so the two sides don't fight over it. */
+typedef struct px_shm_ring
+{
+  uint32_t head;         /* written by the producer only */
+  char pad0[60];
+  uint32_t tail;         /* written by the consumer only */
+  char pad1[60];
+  uint32_t want_space;   /* set by the producer when full, cleared by the
+                          * consumer as it rings the space doorbell */
+  char pad2[60];
+} px_shm_ring_t;
+
+typedef struct px_shm_header
+{
+  uint32_t magic;
+  uint32_t size;         /* bytes of data per ring */
+  char pad[56];
+  px_shm_ring_t rx;      /* device -> parexis */
+  px_shm_ring_t tx;      /* parexis -> device */
+  /* rx data, then tx data */
+} px_shm_header_t;
+
+typedef struct px_shm
+{
+  px_shm_header_t *hdr;
+  int rx_bell, tx_bell, tx_space_bell;
+} px_shm_t;
+
+static inline size_t
+px_shm_mapping_size (uint32_t size)
+{
+  return sizeof (px_shm_header_t) + 2 * (size_t)size;
+}
+
+static inline char *
+px_shm_data (px_shm_header_t *hdr, const px_shm_ring_t *ring)
+{
+  return (char *)(hdr + 1) + (ring == &hdr->tx ? hdr->size : 0);
+}
+
+/* Copies in as much of buf as there is room for, and returns how much */
+static inline size_t
+px_shm_put (px_shm_header_t *hdr, px_shm_ring_t *ring, const void *buf, size_t len)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  uint32_t room = hdr->size - (head - tail);
+  uint32_t n = len < room ? (uint32_t)len : room;
+  uint32_t at = head & (hdr->size - 1);
+  uint32_t first = n < hdr->size - at ? n : hdr->size - at;
+  char *data = px_shm_data (hdr, ring);
+
+  memcpy (data + at, buf, first);
+  memcpy (data, (const char *)buf + first, n - first);
+  __atomic_store_n (&ring->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Copies out up to len bytes, and returns how many */
+static inline size_t
+px_shm_get (px_shm_header_t *hdr, px_shm_ring_t *ring, void *buf, size_t len)
+{
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t avail = head - tail;
+  uint32_t n = len < avail ? (uint32_t)len : avail;
+  uint32_t at = tail & (hdr->size - 1);
+  uint32_t first = n < hdr->size - at ? n : hdr->size - at;
+  const char *data = px_shm_data (hdr, ring);
+
+  memcpy (buf, data + at, first);
+  memcpy ((char *)buf + first, data, n - first);
+  __atomic_store_n (&ring->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+static inline uint32_t
+px_shm_used (const px_shm_ring_t *ring)
+{
+  return __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) -
+    __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+px_shm_ring_bell (int fd)
+{
+  uint64_t one = 1;
+  if (write (fd, &one, sizeof (one)) < 0)
+    return; /* counter saturated, so it's ringing anyway */
+}
+
+/* Maps the rings described by spec. Returns 0, or -1 on failure. */
+static inline int
+px_shm_attach (const char *spec, px_shm_t *shm)
+{
+  int memfd;
+  struct stat st;
+  void *p;
+
+  if (!spec ||
+      sscanf (spec, "%d,%d,%d,%d", &memfd, &shm->rx_bell, &shm->tx_bell,
+        &shm->tx_space_bell) != 4 ||
+      fstat (memfd, &st) < 0)
+    return -1;
+  p = mmap (NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  shm->hdr = (px_shm_header_t *)p;
+  if (shm->hdr->magic != PX_SHM_MAGIC ||
+      px_shm_mapping_size (shm->hdr->size) > (size_t)st.st_size)
+  {
+    munmap (p, (size_t)st.st_size);
+    return -1;
+  }
+  return 0;
+}
+
+/* Device side: console output, returns how much fitted */
+static inline size_t
+px_shm_send (px_shm_t *shm, const void *buf, size_t len)
+{
+  size_t n = px_shm_put (shm->hdr, &shm->hdr->rx, buf, len);
+  if (n)
+    px_shm_ring_bell (shm->rx_bell);
+  return n;
+}
+
+/* Producer side, for a ring found full: asks the consumer to ring the
+ * space doorbell once it has taken something. Returns the room there is
+ * now, as the consumer may have made some before it saw the request. */
+static inline uint32_t
+px_shm_want_space (px_shm_header_t *hdr, px_shm_ring_t *ring)
+{
+  __atomic_store_n (&ring->want_space, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  return hdr->size - px_shm_used (ring);
+}
+
+/* Takes up to len bytes off a ring whose doorbell gets polled. The bell
+ * is only drained once the ring is seen empty, and rung again if data was
+ * added meanwhile and not all of it taken, so it stays readable for as
+ * long as there's data left. The space bell, if any, is rung for a
+ * producer waiting for room. Returns 0 if there was nothing. */
+static inline size_t
+px_shm_take (px_shm_header_t *hdr, px_shm_ring_t *ring, int bell, int space_bell, void *buf, size_t len)
+{
+  uint64_t count;
+  size_t n;
+  int drained = 0;
+  if (px_shm_used (ring) == 0)
+  {
+    if (read (bell, &count, sizeof (count)) < 0)
+      count = 0;
+    drained = 1;
+    if (px_shm_used (ring) == 0)
+      return 0;
+  }
+  n = px_shm_get (hdr, ring, buf, len);
+  if (drained && px_shm_used (ring) != 0)
+    px_shm_ring_bell (bell);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (space_bell >= 0 && __atomic_load_n (&ring->want_space, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n (&ring->want_space, 0, __ATOMIC_RELAXED))
+    px_shm_ring_bell (space_bell);
+  return n;
+}
+
+/* Device side: console input. Poll tx_bell for readability, then call
+ * until this returns 0. */
+static inline size_t
+px_shm_recv (px_shm_t *shm, void *buf, size_t len)
+{
+  return px_shm_take (shm->hdr, &shm->hdr->tx, shm->tx_bell,
+    shm->tx_space_bell, buf, len);
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _PXSLOTMAP_H_
+#define _PXSLOTMAP_H_
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+namespace ParEx
+{
+
+// Generational slot map. Hands out small, stable handles: the bottom 32
+// bits index a slot, and the top 32 count the slot's reuses, so a handle
+// to an erased entry never finds whoever got the slot next. Handle 0 is
+// never handed out. Lookups, inserts and erases are O(1), and erased slots
+// are reused, so storage only grows with the most entries held at once.
+//
+// Only reserve () is safe to call from other threads; it lets a handle be
+// given out before the owning thread gets round to inserting the entry.
+template<typename T>
+class PXSlotMap
+{
+  public:
+    typedef uint64_t handle_t;
+
+    PXSlotMap () : slots_ (), lock_ (), gens_ (), free_ () {}
+
+    // The slot a handle refers to, for keeping side tables indexed in step
+    static size_t index (handle_t h) { return static_cast<size_t> (h & 0xffffffffu); }
+
+    handle_t reserve ()
+    {
+      std::lock_guard<std::mutex> guard (lock_);
+      uint32_t idx;
+      if (free_.empty ())
+      {
+        idx = static_cast<uint32_t> (gens_.size ());
+        gens_.push_back (1);
+      }
+      else
+      {
+        idx = free_.back ();
+        free_.pop_back ();
+      }
+      return (static_cast<handle_t> (gens_[idx]) << 32) | idx;
+    }
+
+    void insert (handle_t h, const T &value)
+    {
+      size_t idx = index (h);
+      if (idx >= slots_.size ())
+        slots_.resize (idx +1);
+      slots_[idx].handle = h;
+      slots_[idx].value = value;
+    }
+
+    handle_t insert (const T &value)
+    {
+      handle_t h = reserve ();
+      insert (h, value);
+      return h;
+    }
+
+    T *find (handle_t h)
+    {
+      size_t idx = index (h);
+      if (h == 0 || idx >= slots_.size () || slots_[idx].handle != h)
+        return NULL;
+      return &slots_[idx].value;
+    }
+
+    const T *find (handle_t h) const
+    {
+      return const_cast<PXSlotMap *> (this)->find (h);
+    }
+
+    bool erase (handle_t h)
+    {
+      if (!find (h))
+        return false;
+      size_t idx = index (h);
+      slots_[idx].handle = 0;
+      slots_[idx].value = T ();
+
+      std::lock_guard<std::mutex> guard (lock_);
+      if (++gens_[idx] == 0)
+        gens_[idx] = 1; // keep 0 out of the handles
+      free_.push_back (static_cast<uint32_t> (idx));
+      return true;
+    }
+
+  private:
+    PXSlotMap (const PXSlotMap &);
+    PXSlotMap &operator = (const PXSlotMap &);
+
+    typedef struct {
+      handle_t handle; // 0 while the slot is free
+      T value;
+    } slot_t;
+
+    std::vector<slot_t> slots_;
+
+    // the handle allocator, shared with reserve ()ing threads
+    std::mutex lock_;
+    std::vector<uint32_t> gens_;
+    std::vector<uint32_t> free_;
+};
+
+} // namespace
+#endif
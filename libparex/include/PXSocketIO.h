@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXSOCKETIO_H_
+#define _PXSOCKETIO_H_
+
+#include "PXIO.h"
+#include <string>
+#include <cstdint>
+
+namespace ParEx
+{
+
+// TCP or Unix-domain stream socket, e.g. a console behind ser2net. The
+// connect is non-blocking, trying each address of the host in turn until
+// one doesn't fail outright; a failed connect shows up as EOF on the
+// channel, and reopen () connects again. Output is queued and flushed by
+// the driver, once connected and as the socket buffer has room.
+class PXSocketIO : public PXIO
+{
+  public:
+    PXSocketIO (const std::string &host, uint16_t port);
+    explicit PXSocketIO (const std::string &path);
+
+    virtual void putc (char c);
+    virtual void reopen ();
+
+    virtual bool is_socket () const { return true; }
+    virtual bool output_pending () const { return !pending_.empty (); }
+    virtual void flush ();
+    virtual int output_wait_fd (bool *writable) const;
+
+  private:
+    int connect ();
+    bool connected ();
+
+    std::string host_; // or path, for Unix-domain sockets
+    uint16_t port_;    // zero for Unix-domain sockets
+    bool connecting_;
+    std::string pending_;
+};
+
+} // namespace 
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXTASK_H_
+#define _PXTASK_H_
+
+// Coroutine support needs C++20, while the library itself is built as C++11,
+// so all of this lives in the header and is only seen by C++20 code.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include "PXChannel.h"
+#include "PXHandler.h"
+#include <coroutine>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <sys/time.h>
+
+namespace ParEx
+{
+
+// Recycles coroutine frames through per-thread free lists, bucketed by size,
+// so that starting thousands of short device scripts doesn't go to the heap
+// each time. Frames over the largest bucket use plain operator new.
+class PXFramePool
+{
+  public:
+    static void *alloc (size_t size)
+    {
+      size_t b = bucket (size);
+      if (b >= buckets)
+        return ::operator new (size);
+      node_t *&head = heads ()[b];
+      if (!head)
+        return ::operator new ((b + 1) * granule);
+      node_t *n = head;
+      head = n->next;
+      return n;
+    }
+
+    static void release (void *p, size_t size)
+    {
+      size_t b = bucket (size);
+      if (b >= buckets)
+      {
+        ::operator delete (p);
+        return;
+      }
+      node_t *n = static_cast<node_t *> (p);
+      n->next = heads ()[b];
+      heads ()[b] = n;
+    }
+
+  private:
+    typedef struct node { struct node *next; } node_t;
+
+    static const size_t granule = 64;
+    static const size_t buckets = 32;
+
+    static size_t bucket (size_t size) { return (size - 1) / granule; }
+    static node_t **heads ()
+    {
+      static thread_local node_t *h[buckets];
+      return h;
+    }
+};
+
+
+// A coroutine running a device script. It starts straight away and runs
+// until its first co_await, after which PXDriver::run () / run_once () resume
+// it as its expectations are met or expire. A task may co_await another
+// task. Destroying a task which is still suspended on an expectation is not
+// allowed, as the channel would be left pointing at the dead awaiter.
+class PXTask
+{
+  public:
+    class promise_type
+    {
+      public:
+        promise_type () : continuation_ (), error_ () {}
+
+        PXTask get_return_object ()
+        {
+          return PXTask (std::coroutine_handle<promise_type>::from_promise (*this));
+        }
+
+        std::suspend_never initial_suspend () noexcept { return {}; }
+
+        // hand over to whoever awaits us, if anyone
+        class final_awaiter
+        {
+          public:
+            bool await_ready () const noexcept { return false; }
+            std::coroutine_handle<> await_suspend (std::coroutine_handle<promise_type> h) noexcept
+            {
+              std::coroutine_handle<> next = h.promise ().continuation_;
+              return next ? next : std::noop_coroutine ();
+            }
+            void await_resume () const noexcept {}
+        };
+        final_awaiter final_suspend () noexcept { return final_awaiter (); }
+
+        void return_void () {}
+        void unhandled_exception () { error_ = std::current_exception (); }
+
+        static void *operator new (size_t size) { return PXFramePool::alloc (size); }
+        static void operator delete (void *p, size_t size) { PXFramePool::release (p, size); }
+
+      private:
+        friend class PXTask;
+
+        std::coroutine_handle<> continuation_;
+        std::exception_ptr error_;
+    };
+
+    PXTask (PXTask &&b) noexcept : handle_ (std::exchange (b.handle_, nullptr)) {}
+    PXTask &operator = (PXTask &&b) noexcept
+    {
+      std::swap (handle_, b.handle_);
+      return *this;
+    }
+    ~PXTask ()
+    {
+      if (handle_)
+        handle_.destroy ();
+    }
+
+    bool done () const { return !handle_ || handle_.done (); }
+
+    // Rethrows anything the script let escape
+    void get () const
+    {
+      if (handle_ && handle_.promise ().error_)
+        std::rethrow_exception (handle_.promise ().error_);
+    }
+
+    class awaiter
+    {
+      public:
+        explicit awaiter (std::coroutine_handle<promise_type> h) : handle_ (h) {}
+        bool await_ready () const noexcept { return handle_.done (); }
+        void await_suspend (std::coroutine_handle<> h) noexcept
+        {
+          handle_.promise ().continuation_ = h;
+        }
+        void await_resume () const
+        {
+          if (handle_.promise ().error_)
+            std::rethrow_exception (handle_.promise ().error_);
+        }
+
+      private:
+        std::coroutine_handle<promise_type> handle_;
+    };
+    awaiter operator co_await () const & noexcept { return awaiter (handle_); }
+
+  private:
+    explicit PXTask (std::coroutine_handle<promise_type> h) : handle_ (h) {}
+    PXTask (const PXTask &);
+    PXTask &operator = (const PXTask &);
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+
+// PXCANCELLED is an expectation cleared away unmet, e.g. as another script
+// awaiting the same channel got its match first
+typedef enum { PXMATCHED, PXTIMEDOUT, PXABORTED, PXCANCELLED } await_status_t;
+
+class await_result_t
+{
+  public:
+    await_status_t status;
+    std::string    text;  // the match or abort text
+
+    explicit operator bool () const { return status == PXMATCHED; }
+};
+
+
+// What a co_await on an expectation suspends on. It registers itself as the
+// expectation's handler, and resumes the script straight from the driver's
+// event loop; nothing is allocated beyond the expectation itself. The script
+// must not add or remove driver channels, or call the blocking waits, from
+// there. Each awaiter is an alternative of its own on the channel, so of
+// several scripts awaiting it, the first to match completes the channel's
+// expectations and the others are resumed as cancelled.
+class PXExpectAwaiter : public PXHandler
+{
+  public:
+    PXExpectAwaiter (PXChannel &chan, std::shared_ptr<PXPattern> pattern, timeval_t timeout)
+      : chan_ (chan), pattern_ (pattern), idle_ (), timeout_ (timeout),
+        handle_ (), result_ { PXTIMEDOUT, std::string () } {}
+    PXExpectAwaiter (PXChannel &chan, timeval_t idle, timeval_t timeout)
+      : chan_ (chan), pattern_ (), idle_ (idle), timeout_ (timeout),
+        handle_ (), result_ { PXTIMEDOUT, std::string () } {}
+
+    bool await_ready () const noexcept { return false; }
+
+    void await_suspend (std::coroutine_handle<> h)
+    {
+      handle_ = h;
+      if (!pattern_)
+      {
+        chan_.add_idle_expect (idle_, timeout_, PXPARALLEL, this);
+        return;
+      }
+      timeval_t expiry;
+      gettimeofday (&expiry, NULL);
+      expiry += timeout_;
+      chan_.add_expect (pattern_, timeout_, expiry, PXPARALLEL, this);
+    }
+
+    await_result_t await_resume () { return std::move (result_); }
+
+    // Resuming may well destroy this awaiter, so nothing can follow it
+    void on_match (channel_id_t, const std::string &str) override
+    {
+      finish (PXMATCHED, str);
+    }
+    void on_abort (channel_id_t, const std::string &str) override
+    {
+      finish (PXABORTED, str);
+    }
+    void on_timeout (channel_id_t, const expectation_t &) override
+    {
+      finish (PXTIMEDOUT, std::string ());
+    }
+    void on_cancel (channel_id_t) override
+    {
+      finish (PXCANCELLED, std::string ());
+    }
+
+  private:
+    void finish (await_status_t status, const std::string &text)
+    {
+      result_.status = status;
+      result_.text = text;
+      handle_.resume ();
+    }
+
+    PXChannel &chan_;
+    std::shared_ptr<PXPattern> pattern_;
+    timeval_t idle_, timeout_;
+    std::coroutine_handle<> handle_;
+    await_result_t result_;
+};
+
+
+// Coroutine friendly view of a channel, e.g.
+//
+//   PXTask login (PXAsyncChannel chan)
+//   {
+//     if (!co_await chan.expect ("login:", 5s))
+//       co_return;
+//     co_await chan.send ("root\n");
+//   }
+class PXAsyncChannel
+{
+  public:
+    explicit PXAsyncChannel (std::shared_ptr<PXChannel> chan) : chan_ (chan) {}
+
+    template<typename Rep, typename Period>
+    PXExpectAwaiter expect (const std::string &expr, std::chrono::duration<Rep, Period> timeout)
+    {
+      return expect (PXPattern::intern (expr), timeout);
+    }
+
+    // Precompiled patterns can be shared across any number of scripts
+    template<typename Rep, typename Period>
+    PXExpectAwaiter expect (std::shared_ptr<PXPattern> pattern, std::chrono::duration<Rep, Period> timeout)
+    {
+      return PXExpectAwaiter (*chan_, pattern, to_timeval (timeout));
+    }
+
+    // Waits for the channel to go quiet for the given time
+    template<typename Rep1, typename Period1, typename Rep2, typename Period2>
+    PXExpectAwaiter idle (std::chrono::duration<Rep1, Period1> quiet, std::chrono::duration<Rep2, Period2> timeout)
+    {
+      return PXExpectAwaiter (*chan_, to_timeval (quiet), to_timeval (timeout));
+    }
+
+    // Writes never block the script, paced writes are fed out by the driver
+    std::suspend_never send (const std::string &str)
+    {
+      chan_->write (str);
+      return std::suspend_never ();
+    }
+
+    PXChannel &channel () const { return *chan_; }
+
+  private:
+    template<typename Rep, typename Period>
+    static timeval_t to_timeval (std::chrono::duration<Rep, Period> d)
+    {
+      auto us = std::chrono::duration_cast<std::chrono::microseconds> (d).count ();
+      timeval_t tv = { (time_t)(us / 1000000), (suseconds_t)(us % 1000000) };
+      return tv;
+    }
+
+    std::shared_ptr<PXChannel> chan_;
+};
+
+} // namespace
+
+#endif // C++20
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PXURING_H_
+#define _PXURING_H_
+
+#include <sys/time.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace ParEx
+{
+
+// Minimal io_uring on raw syscalls, used by PXDriver as an alternative I/O
+// engine. Reads go into a ring of provided buffers owned by this class.
+// Nothing here throws; setup () failing simply means that io_uring is not
+// available and the driver should stay with epoll.
+class PXUring
+{
+  public:
+    PXUring ();
+    ~PXUring ();
+
+    bool setup (unsigned entries, unsigned nbufs, unsigned buf_size);
+    bool active () const { return fd_ >= 0; }
+    int  fd () const { return fd_; }
+
+    // Queue requests, which go to the kernel with the next enter (). The
+    // data of a write must stay put until it has completed. Writes to
+    // sockets go out as sends, so a dead peer doesn't raise SIGPIPE.
+    bool read (int fd, uint64_t token, bool multishot);
+    bool write (int fd, const char *data, size_t len, uint64_t token, bool socket);
+    bool poll (int fd, uint64_t token);
+    bool timeout (const struct timeval &rel, uint64_t token);
+    bool cancel (uint64_t token);
+    bool cancel_timeout (uint64_t token);
+
+    // Submits all queued requests in one go, and waits for at least wait_nr
+    // completions. Returns -1 with errno set on failure.
+    int  enter (unsigned wait_nr);
+
+    typedef struct {
+      uint64_t token;
+      int      res;
+      uint32_t flags;
+    } completion_t;
+    bool next (completion_t *c);
+
+    // Whether the request will complete again (multishot)
+    bool more (const completion_t &c) const;
+
+    // Data of a completed read, to be handed back with recycle () once used
+    const char *data (const completion_t &c) const;
+    void recycle (const completion_t &c);
+
+  private:
+    PXUring (const PXUring &);
+    PXUring &operator = (const PXUring &);
+
+    void *get_sqe ();
+    void teardown ();
+    void add_buffer (unsigned bid);
+
+    int fd_;
+    void *ring_;
+    size_t ring_size_;
+    void *sqes_;
+    size_t sqes_size_;
+    unsigned *sq_head_, *sq_tail_, *sq_array_;
+    unsigned *cq_head_, *cq_tail_;
+    unsigned sq_mask_, sq_entries_, cq_mask_;
+    void *cqes_;
+    unsigned pending_; // queued but not yet submitted
+
+    void *bufring_;
+    char *bufmem_;
+    unsigned nbufs_, buf_size_;
+    uint16_t buf_tail_;
+
+    struct timespec *ts_; // one per sqe slot, each outliving its submission
+};
+
+} // namespace
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _PXWORKERS_H_
+#define _PXWORKERS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace ParEx
+{
+
+// Small work-stealing thread pool for batches of independent tasks, each
+// identified by its index in the batch. Every thread, the caller included,
+// starts out with an even share of the batch and steals from the others
+// once it runs out, so a few slow tasks don't hold everyone up. run ()
+// returns when the whole batch is done. Tasks must not throw, and batches
+// are limited to 2^32 tasks.
+class PXWorkers
+{
+  public:
+    explicit PXWorkers (unsigned threads);
+    ~PXWorkers ();
+
+    // threads working on a batch, counting the caller
+    unsigned size () const { return parts_; }
+
+    void run (size_t n, const std::function<void (size_t)> &task);
+
+  private:
+    PXWorkers (const PXWorkers &);
+    PXWorkers &operator = (const PXWorkers &);
+
+    void thread_main (unsigned self);
+    void work (unsigned self);
+    bool take (unsigned self, size_t *task);
+
+    // What's left of a thread's share, [begin, end) packed into one word so
+    // that its owner taking from the front and thieves taking from the back
+    // can never both get the same task. Padded so that no two shares are on
+    // the same cache line.
+    class share_t
+    {
+      public:
+        share_t () : range (0), pad () {}
+
+        std::atomic<uint64_t> range;
+        char pad[64 - sizeof (std::atomic<uint64_t>)];
+    };
+
+    unsigned parts_;
+    std::unique_ptr<share_t[]> shares_;
+    std::vector<std::thread> threads_;
+
+    std::mutex lock_;
+    std::condition_variable start_, done_;
+    uint64_t batch_;   // bumped for each run ()
+    unsigned busy_;    // pool threads still on the current batch
+    bool quit_;
+    const std::function<void (size_t)> *task_;
+};
+
+} // namespace
+#endif
@@ -31,108 +31,624 @@
  */
 
 #include "PXChannel.h"
+#include "PXDriver.h"
 #include "PXIO.h"
-#include <pcre.h>
+#include "PXProgram.h"
+#include "PXFilter.h"
+#include "PXHandler.h"
 #include <sys/time.h>
+#include <sstream>
+#include <algorithm>
 
 namespace ParEx
 {
 
+const size_t expectation_t::NO_STEP;
+
+
+timeval_t
+expectation_t::idle_deadline (const timeval_t &last_rx) const
+{
+  timeval_t added = expiry;
+  added -= timeout;
+  timeval_t deadline = (added < last_rx) ? last_rx : added;
+  deadline += idle;
+  return deadline;
+}
+
+
+std::string
+expectation_t::what () const
+{
+  if (pattern)
+    return pattern->expr ();
+
+  std::ostringstream oss;
+  oss << "<idle " << idle.tv_sec * 1000 + idle.tv_usec / 1000 << "ms>";
+  return oss.str ();
+}
+
+
 PXChannel::PXChannel (std::shared_ptr<PXIO> io, const std::string &chname)
-  : io_ (io), exps_ (), name_ (chname), buffer_ (), last_match_ ()
+  : io_ (io), id_ (0), owner_ (NULL), exps_ (), name_ (chname), buffer_ (), last_match_ (),
+    last_pattern_ (), groups_ (),
+    aborts_ (), last_abort_ (), last_rx_ (), idle_exps_ (0),
+    prog_ (), pc_ (0), handler_ (), last_handler_ (NULL), demux_ (),
+    filter_ (), line_mode_ (false), tail_idle_ (), scanned_ (0),
+    tail_checked_ (false), eof_ (false),
+    dirty_ (true), writing_ (false), polled_fd_ (-1), read_budget_ (1024), priority_ (0),
+    async_writes_ (false), read_token_ (0), read_fd_ (-1), out_ (),
+    quorum_ (Q_NONE), prechecked_ (false), precheck_ (), dropped_ ()
 {
   // Empty
 }
 
 
 void
-PXChannel::add_expect(const std::string &expr, timeval_t timeout, exp_type_t et)
+PXChannel::add_expect (const std::string &expr, timeval_t timeout, exp_type_t et, PXHandler *handler)
+{
+  timeval_t expiry;
+  gettimeofday (&expiry, NULL);
+  expiry += timeout;
+  add_expect (
+    PXPattern::intern (expr), timeout, expiry, et,
+    handler);
+}
+
+
+void
+PXChannel::add_expect (std::shared_ptr<PXPattern> pattern, timeval_t timeout, const timeval_t &expiry, exp_type_t et, PXHandler *handler)
+{
+  expectation_t exp (pattern, timeout, expiry);
+  exp.handler = handler;
+  push_expect (std::move (exp), et);
+}
+
+
+void
+PXChannel::add_idle_expect (timeval_t idle, timeval_t timeout, exp_type_t et, PXHandler *handler)
 {
   timeval_t expiry;
   gettimeofday (&expiry, NULL);
   expiry += timeout;
-  expectation_t exp (expr, timeout, expiry, NULL);
+  expectation_t exp (idle, timeout, expiry);
+  exp.handler = handler;
+  ++idle_exps_;
+  push_expect (std::move (exp), et);
+}
+
+
+void
+PXChannel::feed (const char *data, size_t len, const timeval_t &now)
+{
+  if (filter_)
+    filter_->filter (data, len, buffer_);
+  else
+    buffer_.append (data, len);
+  last_rx_ = now;
+  tail_checked_ = false;
+  changed ();
+}
+
+
+bool
+PXChannel::capture (const std::string &name, size_t *offset, size_t *length) const
+{
+  size_t n = last_pattern_ ? last_pattern_->group (name) : 0;
+  if (!n || n * 2 > groups_.size () || groups_[2 * n - 2] == std::string::npos)
+    return false;
+  *offset = groups_[2 * n - 2];
+  *length = groups_[2 * n - 1] - *offset;
+  return true;
+}
+
+
+void
+PXChannel::set_line_mode (bool on, timeval_t tail_idle)
+{
+  line_mode_ = on;
+  tail_idle_ = tail_idle;
+  scanned_ = 0;
+  tail_checked_ = false;
+  changed ();
+}
+
+
+PXHandler *
+PXChannel::match_handler () const
+{
+  return last_handler_ ? last_handler_ : handler_.get ();
+}
+
+
+void
+PXChannel::reopen ()
+{
+  io_->reopen ();
+  eof_ = false;
+  dirty_ = true;
+  if (owner_)
+    owner_->refresh_fds (); // the device may have handed out others too
+}
+
+
+void
+PXChannel::push_expect (expectation_t &&exp, exp_type_t et)
+{
   if (et == PXPARALLEL || exps_.empty ())
+    exps_.add ();
+  exps_.back ().push_back (std::move (exp));
+  dirty_ = true;
+  scanned_ = 0; // not tried against anything yet
+  tail_checked_ = false;
+  changed ();
+}
+
+
+void
+PXChannel::clear_expects ()
+{
+  drop_expects ();
+  notify_dropped (NULL, false);
+}
+
+
+void
+PXChannel::drop_expects ()
+{
+  for (auto g = exps_.begin (); g != exps_.end (); ++g)
+    for (auto e = g->begin (); e != g->end (); ++e)
+      if (e->handler &&
+          std::find (dropped_.begin (), dropped_.end (), e->handler) == dropped_.end ())
+        dropped_.push_back (e->handler);
+  exps_.clear ();
+  idle_exps_ = 0;
+  changed ();
+}
+
+
+void
+PXChannel::notify_dropped (PXHandler *told, bool aborted)
+{
+  if (dropped_.empty ())
+    return;
+
+  // a handler may well drop more, so work on a list of our own, and hand
+  // its storage back afterwards
+  std::vector<PXHandler *> dropped;
+  dropped.swap (dropped_);
+  for (auto h = dropped.begin (); h != dropped.end (); ++h)
   {
-    expect_list_t el = { exp };
-    exps_.push_back (el);
+    if (*h == told)
+      continue;
+    if (aborted)
+      (*h)->on_abort (id_, last_abort_);
+    else
+      (*h)->on_cancel (id_);
   }
-  else
-    exps_.back ().push_back (exp);
+  dropped.clear ();
+  if (dropped_.empty ())
+    dropped_.swap (dropped);
 }
 
 
 void
-PXChannel::clear_expects ()
+PXChannel::changed ()
 {
-  expect_groups_t tmp;
-  exps_.swap (tmp);
+  prechecked_ = false; // whatever the workers found no longer applies
+  if (owner_)
+    owner_->refresh (*this);
 }
 
 
 bool
-PXChannel::expectation_met ()
+PXChannel::next_idle (timeval_t *when) const
 {
   bool found = false;
-  for (auto g = exps_.begin (); g != exps_.end () && !found; ++g)
+  if (line_mode_ && !tail_checked_ && !exps_.empty () &&
+      !buffer_.empty () && buffer_[buffer_.size () -1] != '\n')
   {
-    for (auto e = g->begin (); e != g->end () && !found; ++e)
+    found = true;
+    *when = last_rx_;
+    *when += tail_idle_;
+  }
+  if (!idle_exps_)
+    return found;
+
+  for (auto g = exps_.begin (); g != exps_.end (); ++g)
+    for (auto e = g->begin (); e != g->end (); ++e)
     {
-      const char *err = NULL;
-      int erroffset = 0;
-      if (e->compiled_regex == NULL)
-        e->compiled_regex =
-          pcre_compile (
-            e->expr.c_str (),
-            PCRE_MULTILINE | PCRE_NEWLINE_ANY | PCRE_NO_AUTO_CAPTURE,
-            &err, &erroffset, NULL
-          );
-      if (!e->compiled_regex)
+      if (!e->is_idle ())
+        continue;
+      timeval_t t = e->idle_deadline (last_rx_);
+      if (!found || t < *when)
       {
-        fprintf(stderr, "invalid regex '%s' (at %d): %s\n",
-          e->expr.c_str (), erroffset, err);
-        throw E_REGEX ();
+        found = true;
+        *when = t;
       }
+    }
+  return found;
+}
+
+
+void
+PXChannel::add_abort (const std::string &expr)
+{
+  aborts_.push_back (PXPattern::intern (expr));
+  dirty_ = true;
+  prechecked_ = false;
+}
+
+
+void
+PXChannel::clear_aborts ()
+{
+  aborts_.clear ();
+  prechecked_ = false;
+}
+
 
-      unsigned m[3];
-      int num = pcre_exec (
-        static_cast<pcre *>(e->compiled_regex), NULL,
-        buffer_.c_str (), static_cast<int> (buffer_.size ()), 0,
-        PCRE_NOTEMPTY | PCRE_NOTEOL,
-        (int *)m,
-        3);
-      if (num == 1)
+bool
+PXChannel::find_abort (const pattern_list_t &aborts, size_t from, size_t to, size_t *start, size_t *end) const
+{
+  bool found = false;
+  for (auto a = aborts.begin (); a != aborts.end (); ++a)
+  {
+    size_t s, e;
+    if ((*a)->match (buffer_, from, to, &s, &e) && (!found || s < *start))
+    {
+      found = true;
+      *start = s;
+      *end = e;
+    }
+  }
+  return found;
+}
+
+
+PXChannel::match_t
+PXChannel::expectation_met (const pattern_list_t &global_aborts, scan_t &scratch)
+{
+  scan (global_aborts, scratch);
+  return commit (scratch);
+}
+
+
+void
+PXChannel::scan (const pattern_list_t &global_aborts, scan_t &s) const
+{
+  s.found = false;
+  s.tail = false;
+  s.abort_start = std::string::npos;
+  s.abort_end = 0;
+  s.lines_end = scanned_;
+  if (exps_.empty ())
+    return;
+
+  timeval_t now = { 0, 0 };
+  if (idle_exps_ || line_mode_)
+    gettimeofday (&now, NULL);
+
+  // In line mode, only the lines not tried yet, and the unfinished one
+  // once it has gone quiet
+  size_t from = 0, to = buffer_.size ();
+  if (line_mode_)
+  {
+    size_t nl = buffer_.rfind ('\n');
+    s.lines_end = (nl == std::string::npos || nl < scanned_) ? scanned_ : nl + 1;
+    from = scanned_;
+    to = s.lines_end;
+    timeval_t quiet = last_rx_;
+    quiet += tail_idle_;
+    if (s.lines_end < buffer_.size () && !tail_checked_ && !(now < quiet))
+    {
+      to = buffer_.size ();
+      s.tail = true;
+    }
+    if (to <= from && !idle_exps_)
+      return;
+  }
+
+  // Abort patterns are looked for in the same pass, and win over any
+  // expectation that matches later in the buffer
+  size_t as, ae;
+  if (find_abort (aborts_, from, to, &as, &ae))
+  {
+    s.abort_start = as;
+    s.abort_end = ae;
+  }
+  if (find_abort (global_aborts, from, to, &as, &ae) && as < s.abort_start)
+  {
+    s.abort_start = as;
+    s.abort_end = ae;
+  }
+
+  size_t gi = 0;
+  for (auto g = exps_.begin (); g != exps_.end (); ++g, ++gi)
+  {
+    size_t ei = 0;
+    for (auto e = g->begin (); e != g->end (); ++e, ++ei)
+    {
+      size_t start = 0, end = 0;
+      if (e->is_idle ())
       {
-        found = true;
-        last_match_ = buffer_.substr (m[0], m[1]-m[0]);
-        // consume used data and expectation
-        buffer_ = buffer_.substr (m[1]);
-        pcre_free (e->compiled_regex);
-        g->erase (e);
-        break;
+        // gone quiet, so everything seen so far is used up
+        if (s.abort_start != std::string::npos ||
+            now < e->idle_deadline (last_rx_))
+          continue;
       }
+      else if (!(to > from &&
+          e->pattern->match (buffer_, from, to, &start, &end, s.groups) &&
+          start < s.abort_start))
+        continue;
+
+      s.found = true;
+      s.group = gi;
+      s.exp = ei;
+      s.start = start;
+      s.end = end;
+      return;
     }
   }
-  if (found)
+}
+
+
+PXChannel::match_t
+PXChannel::commit (scan_t &s)
+{
+  if (exps_.empty ())
+    return M_NONE;
+  if (s.tail)
   {
+    tail_checked_ = true;
+    changed (); // not idle any more until more data comes in
+  }
+
+  if (s.found)
+  {
+    auto g = exps_.begin () + static_cast<ptrdiff_t> (s.group);
+    auto e = g->begin () + static_cast<ptrdiff_t> (s.exp);
+    size_t step = e->step;
+    last_handler_ = e->handler;
+    if (e->is_idle ())
+    {
+      last_match_.clear ();
+      last_pattern_.reset ();
+      buffer_.clear ();
+      --idle_exps_;
+    }
+    else
+    {
+      last_match_.assign (buffer_, s.start, s.end - s.start);
+      last_pattern_ = e->pattern;
+      groups_.swap (s.groups);
+      for (auto i = groups_.begin (); i != groups_.end (); ++i)
+        if (*i != std::string::npos)
+          *i -= s.start;
+      // consume used data
+      buffer_.erase (0, s.end);
+    }
+    g->erase (e);
+    scanned_ = 0;
+    changed ();
+
     // look for empty lists, and if found clear all expectations on the
     // channel, as we just satisfied a full chain
-    for (auto g = exps_.begin (); g != exps_.end (); ++g)
+    for (g = exps_.begin (); g != exps_.end (); ++g)
       if (g->empty ())
       {
-        clear_expects ();
+        drop_expects ();
         break;
       }
+
+    if (prog_ && step != expectation_t::NO_STEP)
+    {
+      drop_expects ();
+      pc_ = step;
+      match_t res = exec_program ();
+      if (res == M_ABORTED)
+        last_abort_ = last_match_;
+      return res;
+    }
+    return M_MATCHED;
   }
-  return found;
+
+  if (s.abort_start != std::string::npos)
+  {
+    // whoever was waiting on this channel gets told
+    last_handler_ = NULL;
+    for (auto g = exps_.begin (); g != exps_.end () && !last_handler_; ++g)
+      for (auto e = g->begin (); e != g->end () && !last_handler_; ++e)
+        last_handler_ = e->handler;
+    last_abort_.assign (buffer_, s.abort_start, s.abort_end - s.abort_start);
+    buffer_.erase (0, s.abort_end);
+    scanned_ = 0;
+    drop_expects ();
+    return M_ABORTED;
+  }
+  if (line_mode_)
+    scanned_ = s.lines_end;
+  return M_NONE;
+}
+
+
+void
+PXChannel::run (std::shared_ptr<PXProgram> prog)
+{
+  clear_expects ();
+  prog_ = prog;
+  pc_ = 0;
+  exec_program ();
+}
+
+
+PXChannel::match_t
+PXChannel::exec_program ()
+{
+  // guard against programs which loop without ever waiting on the device
+  static const unsigned max_steps = 10000;
+
+  for (unsigned n = 0; n < max_steps; ++n)
+  {
+    if (pc_ >= prog_->size ())
+      break;
+
+    const PXProgram::step_t &s = prog_->step (pc_);
+    timeval_t expiry;
+    switch (s.op)
+    {
+      case PXProgram::OP_SEND:
+        write (s.data);
+        ++pc_;
+        break;
+      case PXProgram::OP_GOTO:
+        pc_ = s.target;
+        break;
+      case PXProgram::OP_EXPECT:
+        gettimeofday (&expiry, NULL);
+        expiry += s.timeout;
+        for (auto b = s.branches.begin (); b != s.branches.end (); ++b)
+        {
+          // alternatives, so each gets its own group
+          expectation_t exp (b->pattern, s.timeout, expiry);
+          exp.step = b->target;
+          push_expect (std::move (exp), PXPARALLEL);
+        }
+        return M_STEPPED;
+      case PXProgram::OP_IDLE:
+        add_idle_expect (s.idle, s.timeout, PXPARALLEL);
+        exps_.back ().back ().step = pc_ +1;
+        return M_STEPPED;
+      case PXProgram::OP_FAIL:
+        prog_.reset ();
+        return M_ABORTED;
+      case PXProgram::OP_DONE:
+      default:
+        prog_.reset ();
+        return M_MATCHED;
+    }
+  }
+
+  bool done = pc_ >= prog_->size (); // running off the end is fine
+  prog_.reset ();
+  return done ? M_MATCHED : M_ABORTED;
+}
+
+
+PXChannel::match_t
+PXChannel::program_timeout ()
+{
+  if (!prog_)
+    return M_NONE;
+
+  drop_expects ();
+  size_t target = prog_->step (pc_).on_timeout;
+  if (target == PXProgram::npos)
+  {
+    prog_.reset ();
+    return M_NONE;
+  }
+  pc_ = target;
+  match_t res = exec_program ();
+  return res == M_ABORTED ? M_NONE : res;
 }
 
 
 void
 PXChannel::write (const std::string &str)
 {
-  for (auto i = str.begin (); i != str.end (); ++i)
-    io_->putc (*i);
+  if (!paced () && !write_pending ())
+  {
+    // batched up and submitted by the driver
+    if (async_writes_)
+      output ().wq += str;
+    else
+      for (auto i = str.begin (); i != str.end (); ++i)
+        io_->putc (*i);
+    if (owner_ && (async_writes_ || io_->output_pending ()))
+      owner_->writing (*this);
+    return;
+  }
+
+  timeval_t now;
+  gettimeofday (&now, NULL);
+  output_t &out = output ();
+  if (!write_pending () && out.next_write < now)
+    out.next_write = now; // don't let an idle period turn into a burst
+  out.outq += str;
+  service_writes (now);
+  if (owner_)
+    owner_->writing (*this);
+}
+
+
+void
+PXChannel::set_pacing (timeval_t char_delay, timeval_t line_delay)
+{
+  output ().pace_char = char_delay;
+  output ().pace_line = line_delay;
+}
+
+
+void
+PXChannel::set_pacing_rate (unsigned bytes_per_sec)
+{
+  long usecs = bytes_per_sec ? 1000000 / static_cast<long> (bytes_per_sec) : 0;
+  output ().pace_char.tv_sec = usecs / 1000000;
+  output ().pace_char.tv_usec = usecs % 1000000;
+}
+
+
+bool
+PXChannel::paced () const
+{
+  return out_ &&
+    (out_->pace_char.tv_sec || out_->pace_char.tv_usec ||
+     out_->pace_line.tv_sec || out_->pace_line.tv_usec);
+}
+
+
+PXChannel::output_t &
+PXChannel::output ()
+{
+  if (!out_)
+    out_.reset (new output_t ());
+  return *out_;
+}
+
+
+void
+PXChannel::service_writes (const timeval_t &now)
+{
+  static const timeval_t retry = { 0, 1000 };
+
+  // write everything whose slot has come up, which may be more than one byte
+  // if the driver woke up late
+  while (write_pending () && !(now < out_->next_write))
+  {
+    char c = out_->outq[out_->outq_pos];
+    try {
+      io_->putc (c);
+    }
+    catch (const PXIO::E_INTR &ei) { continue; }
+    catch (const PXIO::E_AGAIN &ea)
+    {
+      out_->next_write = now;
+      out_->next_write += retry;
+      break;
+    }
+    ++out_->outq_pos;
+    out_->next_write += out_->pace_char;
+    // treat \r\n as a single line ending
+    if (c == '\n' ||
+        (c == '\r' && (!write_pending () || out_->outq[out_->outq_pos] != '\n')))
+      out_->next_write += out_->pace_line;
+  }
+  if (out_ && !write_pending ())
+  {
+    out_->outq.clear ();
+    out_->outq_pos = 0;
+  }
 }
 
 } // namespace
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXDemux.h"
+#include "PXChannel.h"
+#include <errno.h>
+
+namespace ParEx
+{
+
+PXDemux::PXDemux (std::shared_ptr<PXIO> io)
+  : io_ (io), framed_ (false), frame_ (0), routes_ (), cur_ (NULL),
+    at_start_ (true), want_id_ (false), head_ ()
+{
+  // Empty
+}
+
+
+PXDemux::PXDemux (std::shared_ptr<PXIO> io, char frame)
+  : io_ (io), framed_ (true), frame_ (frame), routes_ (), cur_ (NULL),
+    at_start_ (false), want_id_ (false), head_ ()
+{
+  // Empty
+}
+
+
+std::shared_ptr<PXChannel>
+PXDemux::add_route (const std::string &prefix_expr, const std::string &name)
+{
+  if (framed_)
+    throw E_MODE ();
+  std::shared_ptr<PXPattern> prefix (new PXPattern (prefix_expr));
+  std::shared_ptr<PXIO> io (new PXDemuxIO (io_));
+  route_t r = { prefix, 0, std::shared_ptr<PXChannel> (new PXChannel (io, name)) };
+  routes_.push_back (r);
+  return r.chan;
+}
+
+
+std::shared_ptr<PXChannel>
+PXDemux::add_route (char id, const std::string &name)
+{
+  if (!framed_)
+    throw E_MODE ();
+  std::shared_ptr<PXIO> io (new PXDemuxIO (io_));
+  route_t r = { std::shared_ptr<PXPattern> (), id, std::shared_ptr<PXChannel> (new PXChannel (io, name)) };
+  routes_.push_back (r);
+  return r.chan;
+}
+
+
+PXChannel *
+PXDemux::find_route (char id) const
+{
+  for (auto r = routes_.begin (); r != routes_.end (); ++r)
+    if (r->id == id)
+      return r->chan.get ();
+  return NULL;
+}
+
+
+PXDemuxIO::PXDemuxIO (std::shared_ptr<PXIO> io)
+  : PXIO (-1), io_ (io)
+{
+  // Empty
+}
+
+
+ssize_t
+PXDemuxIO::read (char *, size_t)
+{
+  errno = EAGAIN; // the data arrives through the demux
+  return -1;
+}
+
+
+void
+PXDemuxIO::reopen ()
+{
+  // Empty - it's the shared device that gets reopened
+}
+
+} // namespace
@@ -33,49 +33,287 @@
 #include "PXDriver.h"
 #include "PXIO.h"
 #include "PXPrinter.h"
-#include <sys/select.h>
+#include "PXHandler.h"
+#include "PXDemux.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <sys/time.h>
-#include <pcre.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
 
-#define CHID(shptr) reinterpret_cast<channel_id_t>((shptr).get())
-
-static void nowarn_FD_ZERO(fd_set &);
-static void nowarn_FD_SET(int, fd_set &);
-static bool nowarn_FD_ISSET(int, fd_set &);
+#define CHID(shptr) ((shptr)->id_)
 
 namespace ParEx
 {
 
+static const timeval_t io_retry = { 0, 1000 };
+
 PXDriver::PXDriver (std::shared_ptr<PXPrinter> printer)
-  : printer_ (printer), channels_ ()
+  : printer_ (printer), channels_ (), slots_ (), expiry_ (), idle_ (), groups_ (),
+    unchecked_ (), writers_ (), aborts_ (), resched_ (false), events_ (0), rr_ (0), epfd_ (-1), unwatched_ (0),
+    outfd_ (-1), out_waits_ (0),
+    commands_ (), signalled_ (false),
+    wakefd_ (eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)), spin_ (),
+    match_latency_ (), wake_latency_ (), ring_ (), ring_seq_ (0),
+    ring_ops_ (), unarmed_ (), ring_timeout_ (0), ring_deadline_ (), ring_wake_armed_ (false),
+    ring_out_armed_ (false), multishot_ (true), workers_ (), min_batch_ (0),
+    batch_ (), scan_ (), deferred_ (), deferred_data_ ()
 {
   // Empty
 }
 
 
+PXDriver::~PXDriver ()
+{
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+    (*ch)->owner_ = NULL;
+  if (epfd_ >= 0)
+    close (epfd_);
+  if (outfd_ >= 0)
+    close (outfd_);
+  if (wakefd_ >= 0)
+    close (wakefd_);
+}
+
+
 channel_id_t
 PXDriver::add_channel (std::shared_ptr<PXChannel> chan)
 {
-  channels_.push_back (chan);
-  channel_id_t id = CHID(chan);
-  printer_->add_channel (id, chan);
+  channel_id_t id = slots_.reserve ();
+  insert_channel (chan, id);
   return id;
 }
 
 
+void
+PXDriver::insert_channel (std::shared_ptr<PXChannel> chan, channel_id_t chan_id)
+{
+  static const timeval_t never = { INTMAX_MAX, 0 };
+  slots_.insert (chan_id, channels_.size ());
+  channels_.push_back (chan);
+  expiry_.push_back (never);
+  idle_.push_back (never);
+  chan->id_ = chan_id;
+  chan->owner_ = this;
+  refresh (*chan);
+  chan->dirty_ = true;
+  chan->async_writes_ = ring_.active () && chan->io_->write_fd () >= 0;
+  if (epfd_ >= 0)
+    watch (*chan);
+  if (ring_.active ())
+    unarmed_.push_back (chan);
+  if (chan->write_pending () || chan->io_->output_pending ())
+    writing (*chan);
+  printer_->add_channel (chan_id, chan);
+}
+
+
 void
 PXDriver::remove_channel (channel_id_t chan_id)
 {
-  for (auto i = channels_.begin (); i != channels_.end (); ++i)
+  size_t *pos = slots_.find (chan_id);
+  if (!pos)
+    return;
+  size_t at = *pos;
+  std::shared_ptr<PXChannel> chan = channels_[at];
+
+  for (auto g = groups_.begin (); g != groups_.end (); ++g)
+    group_remove (g->second, chan_id);
+  printer_->remove_channel (chan_id, chan);
+  unwatch (*chan);
+  unwait_output (*chan);
+  uring_forget (*chan);
+  for (auto u = unchecked_.begin (); u != unchecked_.end (); )
+    u = (*u == chan) ? unchecked_.erase (u) : u + 1;
+  for (auto u = unarmed_.begin (); u != unarmed_.end (); )
+    u = (*u == chan) ? unarmed_.erase (u) : u + 1;
+  if (chan->writing_)
+  {
+    writers_.erase (std::find (writers_.begin (), writers_.end (), chan));
+    chan->writing_ = false;
+  }
+
+  // the last channel moves into the gap
+  if (at != channels_.size () -1)
+  {
+    channels_[at] = channels_.back ();
+    expiry_[at] = expiry_.back ();
+    idle_[at] = idle_.back ();
+    *slots_.find (CHID(channels_[at])) = at;
+  }
+  channels_.pop_back ();
+  expiry_.pop_back ();
+  idle_.pop_back ();
+  slots_.erase (chan_id);
+  chan->id_ = 0;
+  chan->owner_ = NULL;
+}
+
+
+void
+PXDriver::refresh (PXChannel &chan)
+{
+  static const timeval_t never = { INTMAX_MAX, 0 };
+  const size_t *pos = slots_.find (chan.id_);
+  if (!pos)
+    return;
+  timeval_t next = never;
+  for (auto g = chan.exps_.begin (); g != chan.exps_.end (); ++g)
+    if (!g->empty () && g->front ().expiry < next)
+      next = g->front ().expiry;
+  expiry_[*pos] = next;
+  if (!chan.next_idle (&idle_[*pos]))
+    idle_[*pos] = never;
+}
+
+
+void
+PXDriver::writing (PXChannel &chan)
+{
+  const size_t *pos = slots_.find (chan.id_);
+  if (!pos || chan.writing_)
+    return;
+  chan.writing_ = true;
+  writers_.push_back (channels_[*pos]);
+}
+
+
+void
+PXDriver::refresh_fds ()
+{
+  // a reopen can give other channels new fds too, e.g. the stderr channel
+  // of a process. They may reuse the numbers of the closed ones, so
+  // everything is registered afresh, once nothing holds a stale number.
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+  {
+    unwatch (**ch);
+    unwait_output (**ch);
+  }
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+    watch (**ch);
+  if (ring_.active ())
+    unarmed_ = channels_;
+}
+
+
+std::shared_ptr<PXChannel>
+PXDriver::find_channel (channel_id_t chan_id) const
+{
+  const size_t *pos = slots_.find (chan_id);
+  return pos ? channels_[*pos] : std::shared_ptr<PXChannel> ();
+}
+
+
+PXDriver::channel_list_t &
+PXDriver::find_group (const std::string &group)
+{
+  auto g = groups_.find (group);
+  if (g == groups_.end ())
+    throw E_NO_GROUP ();
+  return g->second.members;
+}
+
+
+void
+PXDriver::add_abort (const std::string &expr)
+{
+  aborts_.push_back (PXPattern::intern (expr));
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+  {
+    (*ch)->dirty_ = true;
+    (*ch)->prechecked_ = false;
+  }
+}
+
+
+void
+PXDriver::clear_aborts ()
+{
+  aborts_.clear ();
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+    (*ch)->prechecked_ = false;
+}
+
+
+void
+PXDriver::group_add (const std::string &group, channel_id_t chan_id)
+{
+  std::shared_ptr<PXChannel> chan = find_channel (chan_id);
+  if (!chan)
+    return;
+  group_t &g = groups_[group];
+  if (g.ids.insert (chan_id).second)
+    g.members.push_back (chan);
+}
+
+
+void
+PXDriver::group_remove (const std::string &group, channel_id_t chan_id)
+{
+  auto g = groups_.find (group);
+  if (g == groups_.end ())
+    throw E_NO_GROUP ();
+  group_remove (g->second, chan_id);
+}
+
+
+void
+PXDriver::group_remove (group_t &g, channel_id_t chan_id)
+{
+  // removing channels doesn't need to look through groups they're not in
+  if (!g.ids.erase (chan_id))
+    return;
+  for (auto i = g.members.begin (); i != g.members.end (); ++i)
     if (CHID(*i) == chan_id)
     {
-      printer_->remove_channel (chan_id, *i);
-      channels_.erase (i);
+      g.members.erase (i);
       return;
     }
 }
 
 
+void
+PXDriver::group_clear (const std::string &group)
+{
+  groups_.erase (group);
+}
+
+
+void
+PXDriver::broadcast_write (const std::string &group, const std::string &str)
+{
+  channel_list_t &members = find_group (group);
+  for (auto i = members.begin (); i != members.end (); ++i)
+    (*i)->write (str);
+}
+
+
+void
+PXDriver::broadcast_expect (const std::string &group, const std::string &expr, timeval_t timeout, exp_type_t et)
+{
+  channel_list_t &members = find_group (group);
+  std::shared_ptr<PXPattern> pattern (PXPattern::intern (expr));
+  timeval_t expiry;
+  gettimeofday (&expiry, NULL);
+  expiry += timeout;
+  for (auto i = members.begin (); i != members.end (); ++i)
+    (*i)->add_expect (pattern, timeout, expiry, et);
+}
+
+
+void
+PXDriver::broadcast_run (const std::string &group, std::shared_ptr<PXProgram> prog)
+{
+  channel_list_t &members = find_group (group);
+  for (auto i = members.begin (); i != members.end (); ++i)
+    (*i)->run (prog);
+}
+
+
 static bool have_expectations (const expect_groups_t &exps)
 {
   for (auto i = exps.begin (); i != exps.end (); ++i)
@@ -108,141 +346,1457 @@ PXDriver::wait_for_all ()
 void
 PXDriver::wait_for_one (channel_id_t chan_id)
 {
+  check_all ();
   while (have_expectations ())
-    if (wait_for_any () == chan_id)
-      break;
+  {
+    channel_id_t matched;
+    expect_handle_t expired;
+    wait_t res = wait_step (&matched, &expired, false);
+    if (res == W_TIMEOUT)
+      throw TIMEOUT ();
+    // other channels aborting doesn't concern us
+    if (matched != chan_id)
+      continue;
+    if (res == W_ABORTED)
+      throw_aborted (matched);
+    break;
+  }
+}
+
+
+void
+PXDriver::throw_aborted (channel_id_t chan_id)
+{
+  ABORTED a = { chan_id };
+  throw a;
 }
 
 
 PXDriver::expect_handle_t
-PXDriver::next_expect () const
+PXDriver::next_expect (bool quorum) const
 {
-  PXChannel *chan = NULL;
+  std::shared_ptr<PXChannel> chan;
   expectation_t exp;
   timeval_t next = { INTMAX_MAX, INTMAX_MAX };
-  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
-    for (auto i = (*ch)->exps_.begin (); i != (*ch)->exps_.end (); ++i)
+  size_t pos = channels_.size ();
+  for (size_t i = 0; i < expiry_.size (); ++i)
+    if (expiry_[i] < next &&
+        (!quorum || channels_[i]->quorum_ == PXChannel::Q_PENDING))
     {
-      if (i->front ().expiry < next)
-      {
-        exp = i->front ();
-        chan = ch->get ();
-        next = exp.expiry;
-      }
+      next = expiry_[i];
+      pos = i;
+    }
+  if (pos == channels_.size ())
+    return std::make_pair (chan, exp);
+
+  chan = channels_[pos];
+  for (auto i = chan->exps_.begin (); i != chan->exps_.end (); ++i)
+  {
+    if (!i->empty () && !(next < i->front ().expiry))
+    {
+      exp = i->front ();
+      break;
     }
+  }
   return std::make_pair (chan, exp);
 }
 
 
-int
-PXDriver::make_fd_set (const channel_list_t &channels, fd_set &fds) const
+void
+PXDriver::check_all ()
+{
+  // start somewhere else each time, so the first channels added don't always
+  // win when several have matches waiting
+  unchecked_.clear ();
+  size_t n = channels_.size ();
+  if (n)
+  {
+    size_t first = rr_++ % n;
+    unchecked_.insert (
+      unchecked_.end (), channels_.begin () + (ptrdiff_t)first, channels_.end ());
+    unchecked_.insert (
+      unchecked_.end (), channels_.begin (), channels_.begin () + (ptrdiff_t)first);
+  }
+  schedule (unchecked_);
+}
+
+
+void
+PXDriver::schedule (channel_list_t &channels) const
+{
+  auto higher = [] (const std::shared_ptr<PXChannel> &a, const std::shared_ptr<PXChannel> &b)
+    {
+      return a->priority_ > b->priority_;
+    };
+
+  // usually nothing to do, and stable_sort wants a scratch buffer from the
+  // heap, so short lists are sorted in place
+  if (std::is_sorted (channels.begin (), channels.end (), higher))
+    return;
+  if (channels.size () > 64)
+  {
+    std::stable_sort (channels.begin (), channels.end (), higher);
+    return;
+  }
+  for (auto i = channels.begin () + 1; i != channels.end (); ++i)
+    std::rotate (std::upper_bound (channels.begin (), i, *i, higher), i, i + 1);
+}
+
+
+void
+PXDriver::set_match_workers (unsigned workers, size_t min_batch)
+{
+  workers_.reset (workers ? new PXWorkers (workers) : NULL);
+  min_batch_ = min_batch;
+}
+
+
+void
+PXDriver::precheck (const channel_list_t &channels)
 {
-  int highest = 0;
+  // each channel only once, however often it's on the list
+  batch_.clear ();
   for (auto ch = channels.begin (); ch != channels.end (); ++ch)
   {
-    int fd = (*ch)->io_->select_fd ();
-    if (fd > highest)
-      highest = fd;
-    nowarn_FD_SET(fd, fds);
+    PXChannel &chan = **ch;
+    if (chan.prechecked_ || chan.prog_ || chan.exps_.empty ())
+      continue;
+    chan.prechecked_ = true;
+    if (!chan.precheck_)
+      chan.precheck_.reset (new PXChannel::scan_t ());
+    batch_.push_back (&chan);
+  }
+
+  if (batch_.size () < min_batch_)
+  {
+    for (auto ch = batch_.begin (); ch != batch_.end (); ++ch)
+      (*ch)->prechecked_ = false;
+    return;
   }
-  return highest;
+  workers_->run (batch_.size (),
+    [this] (size_t i) { batch_[i]->scan (aborts_, *batch_[i]->precheck_); });
 }
 
 
-bool
+PXChannel::match_t
 PXDriver::check_expectations (channel_list_t &channels, channel_id_t *matched)
 {
-  for (auto ch = channels.begin (); ch != channels.end (); ++ch)
+  if (workers_)
+    precheck (channels);
+
+  for (auto ch = channels.begin (); ch != channels.end (); )
   {
-    if ((*ch)->expectation_met ())
+    PXChannel::match_t res;
+    if ((*ch)->prechecked_)
+    {
+      (*ch)->prechecked_ = false;
+      res = (*ch)->commit (*(*ch)->precheck_);
+    }
+    else
+      res = (*ch)->expectation_met (aborts_, scan_);
+    if (res == PXChannel::M_NONE)
+    {
+      ++ch;
+      continue;
+    }
+
+    PXHandler *handler = (*ch)->match_handler ();
+    if (res == PXChannel::M_ABORTED)
+    {
+      printer_->aborted (CHID(*ch), (*ch)->last_abort ());
+      if (handler)
+        handler->on_abort (CHID(*ch), (*ch)->last_abort ());
+    }
+    else
     {
-      *matched = CHID(*ch);
+      // idle matches have nothing to measure from
+      if (!(*ch)->last_match ().empty ())
+      {
+        timeval_t now;
+        gettimeofday (&now, NULL);
+        now -= (*ch)->last_rx_;
+        match_latency_.add (now);
+      }
       printer_->matched (CHID(*ch), (*ch)->last_match ());
-      return true;
+      if (handler)
+        handler->on_match (CHID(*ch), (*ch)->last_match ());
+    }
+    (*ch)->notify_dropped (handler, res == PXChannel::M_ABORTED);
+    ++events_;
+
+    if (res == PXChannel::M_STEPPED)
+    {
+      // a program moved on, and its next expectation may already be in the
+      // buffer, so look at the same channel again
+      resched_ = true;
+      continue;
     }
+
+    *matched = CHID(*ch);
+    // those after the matched channel have not been checked yet, and get
+    // their turn before it is looked at again. Workers may have already,
+    // but only hits are kept, as idle deadlines may pass meanwhile.
+    for (auto i = ch + 1; i != channels.end (); ++i)
+      if ((*i)->prechecked_ && !(*i)->precheck_->hit ())
+        (*i)->prechecked_ = false;
+    std::shared_ptr<PXChannel> last = *ch;
+    channels.erase (channels.begin (), ch + 1);
+    channels.push_back (last);
+    return res;
   }
-  return false;
+  channels.clear ();
+  return PXChannel::M_NONE;
 }
 
 
-channel_id_t
-PXDriver::wait_for_any ()
+bool
+PXDriver::writes_pending () const
 {
-  if (!have_expectations ())
-    throw TIMEOUT (); // we'd be waiting for eternity otherwise...
-
-  // check for any outstanding matches
-  channel_id_t matched;
-  if (check_expectations (channels_, &matched))
-    return matched;
+  for (auto ch = writers_.begin (); ch != writers_.end (); ++ch)
+    if ((*ch)->write_pending () || (*ch)->async_write_pending () ||
+        (*ch)->io_->output_pending ())
+      return true;
+  return false;
+}
 
-  // find next timeout
-  expect_handle_t next = next_expect ();
 
-  int num = 0;
-  timeval_t left;
-  do {
-    timeval_t now;
-    gettimeofday (&now, NULL);
-    left = next.second.expiry;
-    if (now < next.second.expiry)
-      left -= now;
-    else
-      left = { 0, 0 };
+void
+PXDriver::service_writes (const timeval_t &now, timeval_t &wake)
+{
+  // only the channels written to, which drop off the list once all is out
+  for (auto ch = writers_.begin (); ch != writers_.end (); )
+  {
+    // paced output first, so what it hands the device goes out right away
+    if ((*ch)->write_pending ())
+    {
+      (*ch)->service_writes (now);
+      if (!(*ch)->write_pending ())
+        wake = now;
+      else if ((*ch)->out_->next_write < wake)
+        wake = (*ch)->out_->next_write;
+    }
 
-    fd_set fds;
-    nowarn_FD_ZERO(fds);
-    num = select (make_fd_set (channels_, fds) +1, &fds, NULL, NULL, &left);
-    if (num > 0)
+    // devices queueing output themselves are waited on for room, or
+    // failing that retried every millisecond. Once all out, don't sleep
+    // before the caller gets to see that.
+    PXIO &io = *(*ch)->io_;
+    if (io.output_pending ())
     {
-      // read any available data into match buffers
-      channel_list_t chans_to_check;
-      for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+      io.flush ();
+      if (!io.output_pending ())
+        wake = now;
+    }
+    if (io.output_pending ())
+    {
+      if (!wait_output (**ch))
       {
-        if (nowarn_FD_ISSET((*ch)->io_->select_fd (), fds))
-        {
-          chans_to_check.push_back (*ch);
-          try {
-            char c = (*ch)->io_->getc ();
-            printer_->out (CHID(*ch), c);
-            (*ch)->buffer_ += c;
-          }
-          catch (const PXIO::E_AGAIN &ea) {}
-          catch (const PXIO::E_INTR &ei) {} // throw CANCEL?
-          catch (const PXIO::E_EOF &eo) {} // remove channel?
-        }
+        timeval_t retry = now;
+        retry += io_retry;
+        if (retry < wake)
+          wake = retry;
       }
+    }
+    else if ((*ch)->out_ && (*ch)->out_->wait_fd >= 0)
+      unwait_output (**ch);
+
+    if ((*ch)->write_pending () || (*ch)->async_write_pending () ||
+        io.output_pending ())
+    {
+      ++ch;
+      continue;
+    }
+    (*ch)->writing_ = false;
+    *ch = writers_.back ();
+    writers_.pop_back ();
+  }
+}
+
+
+bool
+PXDriver::poll_once (const timeval_t &deadline, channel_list_t &ready)
+{
+  timeval_t now;
+  gettimeofday (&now, NULL);
+
+  // wake up for whichever comes first, the deadline or a paced write
+  timeval_t wake = deadline;
+  service_writes (now, wake);
 
-      // regex on the match buffers
-      if (check_expectations (chans_to_check, &matched))
-        return matched;
+  if (ring_.active ())
+    return uring_poll (&wake, now, ready);
 
-      printer_->flush ();
+  // the same epoll set a host gets from event_fd (), so there's no limit on
+  // the number of channels or the fds they have
+  if (event_fd () < 0)
+    return false;
+  epoll_event evs[64];
+  int num = wait_events (evs, 64, wake, now);
+  if (num < 0)
+    return errno == EINTR;
+  take_events (evs, num, now, ready);
+  return true;
+}
+
+
+// epoll_wait () to the microsecond, as paced writes need, where the kernel
+// can do it, and otherwise to the next millisecond
+static int
+wait_until (int epfd, epoll_event *evs, int max, const timeval_t &now, const timeval_t &until)
+{
+  bool forever = until.tv_sec == INTMAX_MAX;
+  timeval_t left = { 0, 0 };
+  if (!forever && now < until)
+  {
+    left = until;
+    left -= now;
+  }
+#ifdef __NR_epoll_pwait2
+  static std::atomic<bool> have_pwait2 (true);
+  if (have_pwait2.load (std::memory_order_relaxed))
+  {
+    struct timespec ts = { left.tv_sec, left.tv_usec * 1000 };
+    int num = (int)syscall (__NR_epoll_pwait2, epfd, evs, max, forever ? NULL : &ts, NULL, 0);
+    if (num >= 0 || errno != ENOSYS)
+      return num;
+    have_pwait2.store (false, std::memory_order_relaxed);
+  }
+#endif
+  long ms = -1;
+  if (!forever)
+    ms = left.tv_sec >= INT_MAX / 1000 ? INT_MAX :
+      left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+  return epoll_wait (epfd, evs, max, static_cast<int> (ms));
+}
+
+
+int
+PXDriver::wait_events (epoll_event *evs, int max, const timeval_t &wake, timeval_t &now)
+{
+  // in low latency mode, spin for a while before giving up the cpu
+  timeval_t spin_end = now;
+  spin_end += spin_;
+  bool spinning = spin_.tv_sec || spin_.tv_usec;
+
+  for (;;)
+  {
+    // devices epoll can't wait on, e.g. regular files, are always readable
+    int num = wait_until (epfd_, evs, max, now, spinning || unwatched_ ? now : wake);
+    gettimeofday (&now, NULL);
+    if (num != 0 || unwatched_)
+      return num;
+
+    if (spinning && now < wake)
+    {
+      spinning = now < spin_end;
+      continue;
     }
-    else
-      if (errno == EINTR)
-        num = 1; // fib it and loop again
-  } while (num > 0 && (left.tv_sec || left.tv_usec));
+    if (!(now < wake) && wake.tv_sec != INTMAX_MAX)
+    {
+      timeval_t late = now;
+      late -= wake;
+      wake_latency_.add (late);
+    }
+    return 0;
+  }
+}
 
-  printer_->timedout (
-    (channel_id_t)next.first, next.second.expr, next.second.timeout);
-  printer_->flush ();
-  throw TIMEOUT ();
+
+void
+PXDriver::read_channel (const std::shared_ptr<PXChannel> &chan, const timeval_t &now, channel_list_t &ready)
+{
+  // a single read, as not all devices are non-blocking
+  char buf[4096];
+  ssize_t len = chan->io_->read (buf, std::min (chan->read_budget_, sizeof (buf)));
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (len <= 0)
+    channel_eof (chan);
+  else
+    deliver (chan, buf, (size_t)len, now, ready);
 }
 
 
-} // namespace
+void
+PXDriver::deliver (const std::shared_ptr<PXChannel> &chan, const char *data, size_t len, const timeval_t &now, channel_list_t &ready)
+{
+  if (chan->demux_)
+  {
+    chan->demux_->split (data, len,
+      [&] (PXChannel *sub, const char *d, size_t n)
+      {
+        if (sub)
+          deliver (sub->shared_from_this (), d, n, now, ready);
+        else
+          take (chan, d, n, now, ready);
+      });
+    return;
+  }
+  take (chan, data, len, now, ready);
+}
+
+
+void
+PXDriver::take (const std::shared_ptr<PXChannel> &chan, const char *data, size_t len, const timeval_t &now, channel_list_t &ready)
+{
+  ready.push_back (chan);
+  for (size_t i = 0; i < len; ++i)
+    printer_->out (CHID(chan), data[i]);
+  chan->feed (data, len, now);
+  if (chan->handler_)
+  {
+    deferred_t d = { chan, deferred_data_.size (), len };
+    deferred_.push_back (d);
+    deferred_data_.append (data, len);
+    ++events_;
+  }
+}
 
-#pragma GCC diagnostic ignored "-Wsign-conversion"
-static void nowarn_FD_ZERO(fd_set &fds)
+
+void
+PXDriver::channel_eof (const std::shared_ptr<PXChannel> &chan)
 {
-  FD_ZERO(&fds);
+  // stop polling it until it's reopened
+  chan->eof_ = true;
+  chan->changed ();
+  unwatch (*chan);
+  if (chan->handler_)
+  {
+    deferred_t d = { chan, 0, std::string::npos };
+    deferred_.push_back (d);
+  }
+  ++events_;
 }
-static void nowarn_FD_SET(int fd, fd_set &fds)
+
+
+void
+PXDriver::dispatch_deferred ()
 {
-  FD_SET(fd, &fds);
+  // by index and copying each out, in case a handler reads more
+  for (size_t i = 0; i < deferred_.size (); ++i)
+  {
+    std::shared_ptr<PXChannel> chan = deferred_[i].chan;
+    size_t off = deferred_[i].off, len = deferred_[i].len;
+    PXHandler *handler = chan->handler_.get ();
+    if (!handler)
+      continue;
+    if (len == std::string::npos)
+      handler->on_eof (CHID(chan));
+    else
+      handler->on_data (CHID(chan), deferred_data_.data () + off, len);
+  }
+  deferred_.clear ();
+  deferred_data_.clear ();
 }
-static bool nowarn_FD_ISSET(int fd, fd_set &fds)
+
+
+void
+PXDriver::find_idle (const timeval_t &now, timeval_t &wake, channel_list_t &due) const
 {
-  return FD_ISSET(fd, &fds);
+  for (size_t i = 0; i < idle_.size (); ++i)
+  {
+    if (now < idle_[i])
+    {
+      if (idle_[i] < wake)
+        wake = idle_[i];
+    }
+    else
+      due.push_back (channels_[i]);
+  }
 }
+
+
+PXDriver::wait_t
+PXDriver::wait_step (channel_id_t *matched, expect_handle_t *expired, bool quorum)
+{
+  resched_ = true;
+  for (;;)
+  {
+    run_commands ();
+
+    timeval_t now;
+    gettimeofday (&now, NULL);
+
+    // channels which have gone quiet long enough don't need new data to
+    // match, the rest only needs to be woken up for in time
+    timeval_t wake = { INTMAX_MAX, 0 };
+    find_idle (now, wake, unchecked_);
+
+    // regex on the match buffers
+    PXChannel::match_t res = check_expectations (unchecked_, matched);
+    printer_->flush ();
+    if (res != PXChannel::M_NONE)
+      return res == PXChannel::M_MATCHED ? W_MATCHED : W_ABORTED;
+
+    // find next timeout, which running programs may have changed
+    if (resched_)
+    {
+      *expired = next_expect (quorum);
+      resched_ = false;
+      if (!expired->first)
+        return W_TIMEOUT; // we'd be waiting for eternity otherwise...
+    }
+    if (expired->second.expiry < wake)
+      wake = expired->second.expiry;
+
+    if (now < expired->second.expiry && poll_once (wake, unchecked_))
+      continue;
+
+    std::shared_ptr<PXChannel> chan = expired->first;
+    printer_->timedout (
+      CHID(chan), expired->second.what (), expired->second.timeout);
+
+    // a handler of the expectation's own, e.g. a suspended script, may be
+    // gone once told, so the expectations go first, as in expire ()
+    PXHandler *own = expired->second.handler;
+    if (own)
+      chan->drop_expects ();
+    timed_out (chan, expired->second);
+    if (own)
+      chan->notify_dropped (own, false);
+
+    // a program may have somewhere else to go on a timeout
+    res = (now < expired->second.expiry) ?
+      PXChannel::M_NONE : chan->program_timeout ();
+    if (res == PXChannel::M_STEPPED)
+    {
+      unchecked_.push_back (chan);
+      resched_ = true;
+      continue;
+    }
+    if (res == PXChannel::M_MATCHED)
+      program_done (chan);
+    printer_->flush ();
+    if (res == PXChannel::M_MATCHED)
+    {
+      *matched = CHID(chan);
+      return W_MATCHED;
+    }
+    return W_TIMEOUT;
+  }
+}
+
+
+channel_id_t
+PXDriver::wait_for_any ()
+{
+  // check for any outstanding matches, as expectations may have been added
+  // since we last looked
+  check_all ();
+
+  channel_id_t matched;
+  expect_handle_t expired;
+  wait_t res = wait_step (&matched, &expired, false);
+  if (res == W_TIMEOUT)
+    throw TIMEOUT ();
+  if (res == W_ABORTED)
+    throw_aborted (matched);
+  return matched;
+}
+
+
+PXDriver::quorum_t
+PXDriver::wait_for_n (const channel_id_list_t &chan_ids, size_t n)
+{
+  channel_list_t set;
+  for (auto i = chan_ids.begin (); i != chan_ids.end (); ++i)
+  {
+    std::shared_ptr<PXChannel> chan = find_channel (*i);
+    if (chan)
+      set.push_back (chan);
+  }
+  return wait_for_quorum (set, n);
+}
+
+
+PXDriver::quorum_t
+PXDriver::wait_for_group (const std::string &group, size_t n)
+{
+  return wait_for_quorum (find_group (group), n);
+}
+
+
+PXDriver::quorum_t
+PXDriver::wait_for_quorum (const channel_list_t &set, size_t n)
+{
+  size_t done = 0, left = 0;
+  for (auto ch = set.begin (); ch != set.end (); ++ch)
+  {
+    if ((*ch)->quorum_ != PXChannel::Q_NONE)
+      continue; // listed twice
+    if (ParEx::have_expectations ((*ch)->exps_))
+    {
+      (*ch)->quorum_ = PXChannel::Q_PENDING;
+      ++left;
+    }
+    else
+    {
+      (*ch)->quorum_ = PXChannel::Q_DONE;
+      ++done;
+    }
+  }
+
+  // only do the full scan once, after that we only look at channels which
+  // have seen new data, and only the channel that matched can have made
+  // progress towards the quorum
+  check_all ();
+  try {
+    while (done < n && done + left >= n)
+    {
+      channel_id_t matched;
+      expect_handle_t expired;
+      wait_t res = wait_step (&matched, &expired, true);
+      if (res == W_MATCHED)
+      {
+        PXChannel *ch = find_channel (matched).get ();
+        if (ch && ch->quorum_ == PXChannel::Q_PENDING &&
+            !ParEx::have_expectations (ch->exps_))
+        {
+          ch->quorum_ = PXChannel::Q_DONE;
+          ++done;
+          --left;
+        }
+      }
+      else if (res == W_ABORTED)
+      {
+        // expectations are already gone, it just can't count as matched
+        PXChannel *ch = find_channel (matched).get ();
+        if (ch && ch->quorum_ == PXChannel::Q_PENDING)
+        {
+          ch->quorum_ = PXChannel::Q_FAILED;
+          --left;
+        }
+      }
+      else
+      {
+        // only channels in the set time out here, and this one won't make
+        // it, so stop waiting on it
+        PXChannel *ch = expired.first.get ();
+        if (!ch)
+          break; // nothing left which could end the wait
+        ch->clear_expects ();
+        ch->quorum_ = PXChannel::Q_FAILED;
+        --left;
+      }
+    }
+  }
+  catch (...)
+  {
+    for (auto ch = set.begin (); ch != set.end (); ++ch)
+      (*ch)->quorum_ = PXChannel::Q_NONE;
+    throw;
+  }
+
+  quorum_t result = { done >= n, channel_id_list_t (), channel_id_list_t () };
+  for (auto ch = set.begin (); ch != set.end (); ++ch)
+  {
+    if ((*ch)->quorum_ == PXChannel::Q_DONE)
+      result.matched.push_back (CHID(*ch));
+    else if ((*ch)->quorum_ != PXChannel::Q_NONE)
+      result.pending.push_back (CHID(*ch));
+    (*ch)->quorum_ = PXChannel::Q_NONE;
+  }
+  return result;
+}
+
+
+size_t
+PXDriver::group_size (const std::string &group)
+{
+  return find_group (group).size ();
+}
+
+
+void
+PXDriver::drain_writes ()
+{
+  static const timeval_t forever = { INTMAX_MAX, 0 };
+  while (writes_pending ())
+  {
+    // data read meanwhile stays in the match buffers for the next wait
+    channel_list_t ignored;
+    bool ok = poll_once (forever, ignored);
+    printer_->flush ();
+    if (!ok)
+      break;
+  }
+}
+
+
+void
+PXDriver::timed_out (std::shared_ptr<PXChannel> chan, const expectation_t &exp)
+{
+  PXHandler *handler = exp.handler ? exp.handler : chan->handler_.get ();
+  if (handler)
+    handler->on_timeout (CHID(chan), exp);
+  ++events_;
+}
+
+
+void
+PXDriver::program_done (std::shared_ptr<PXChannel> chan)
+{
+  // a program which a timeout took on to its end counts as matched
+  printer_->matched (CHID(chan), chan->last_match ());
+  PXHandler *handler = chan->handler_.get ();
+  if (handler)
+    handler->on_match (CHID(chan), chan->last_match ());
+  ++events_;
+}
+
+
+void
+PXDriver::expire (const timeval_t &now, timeval_t &wake)
+{
+  for (size_t pos = 0; pos < channels_.size (); ++pos)
+  {
+    if (now < expiry_[pos])
+    {
+      if (expiry_[pos] < wake)
+        wake = expiry_[pos];
+      continue;
+    }
+
+    // a copy, as a handler may remove it
+    std::shared_ptr<PXChannel> chan = channels_[pos];
+    for (auto i = chan->exps_.begin (); i != chan->exps_.end (); ++i)
+    {
+      if (now < i->front ().expiry)
+      {
+        if (i->front ().expiry < wake)
+          wake = i->front ().expiry;
+        continue;
+      }
+
+      // a copy, as the expectations are about to go away
+      expectation_t exp = i->front ();
+      printer_->timedout (CHID(chan), exp.what (), exp.timeout);
+      PXChannel::match_t res = chan->program_timeout ();
+      if (res == PXChannel::M_STEPPED)
+        unchecked_.push_back (chan);
+      else
+        chan->drop_expects ();
+
+      // only now, as the handler may well add new expectations
+      timed_out (chan, exp);
+      chan->notify_dropped (exp.handler ? exp.handler : chan->handler_.get (), false);
+      if (res == PXChannel::M_MATCHED)
+        program_done (chan);
+
+      // the program may have new expectations with their own expiry
+      for (auto j = chan->exps_.begin (); j != chan->exps_.end (); ++j)
+        if (j->front ().expiry < wake)
+          wake = j->front ().expiry;
+      break;
+    }
+  }
+}
+
+
+int
+PXDriver::run_until (const timeval_t &deadline)
+{
+  events_ = 0;
+  check_all ();
+  for (;;)
+  {
+    run_commands ();
+
+    timeval_t now;
+    gettimeofday (&now, NULL);
+
+    timeval_t wake = deadline;
+    find_idle (now, wake, unchecked_);
+
+    // dispatch everything that's already in the match buffers
+    channel_id_t matched;
+    while (check_expectations (unchecked_, &matched) != PXChannel::M_NONE)
+      ;
+    expire (now, wake);
+    printer_->flush ();
+
+    if (events_ || !(now < deadline))
+      return events_;
+    if (!poll_once (wake, unchecked_))
+      return -1;
+  }
+}
+
+
+int
+PXDriver::run_once (timeval_t timeout)
+{
+  timeval_t deadline;
+  gettimeofday (&deadline, NULL);
+  deadline += timeout;
+  return run_until (deadline);
+}
+
+
+int
+PXDriver::run ()
+{
+  static const timeval_t forever = { INTMAX_MAX, 0 };
+  int total = 0;
+  while (have_expectations () || writes_pending ())
+  {
+    int n = run_until (forever);
+    if (n < 0)
+      return -1;
+    total += n;
+  }
+  return total;
+}
+
+
+int
+PXDriver::event_fd ()
+{
+  // completions, including those of the wakeup fd, make the ring readable
+  if (ring_.active ())
+    return ring_.fd ();
+  if (epfd_ >= 0)
+    return epfd_;
+  epfd_ = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd_ < 0)
+    return -1;
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+    watch (**ch);
+  for (int fd : { wakefd_, outfd_ })
+  {
+    if (fd < 0)
+      continue;
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = fd == wakefd_ ? &wakefd_ : NULL;
+    epoll_ctl (epfd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+  return epfd_;
+}
+
+
+void
+PXDriver::watch (PXChannel &chan)
+{
+  if (chan.eof_ || epfd_ < 0)
+    return;
+  int fd = chan.io_->select_fd ();
+  if (chan.polled_fd_ == fd)
+    return;
+  unwatch (chan);
+  if (fd < 0)
+    return; // e.g. demuxed channels, which get their data handed to them
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &chan;
+  if (epoll_ctl (epfd_, EPOLL_CTL_ADD, fd, &ev) == 0)
+    chan.polled_fd_ = fd;
+  else
+  {
+    // e.g. regular files, which are always readable anyway
+    chan.polled_fd_ = -2;
+    ++unwatched_;
+  }
+}
+
+
+void
+PXDriver::unwatch (PXChannel &chan)
+{
+  if (chan.polled_fd_ >= 0)
+    epoll_ctl (epfd_, EPOLL_CTL_DEL, chan.polled_fd_, NULL);
+  else if (chan.polled_fd_ == -2)
+    --unwatched_;
+  chan.polled_fd_ = -1;
+}
+
+
+bool
+PXDriver::wait_output (PXChannel &chan)
+{
+  bool writable = false;
+  int fd = chan.io_->output_wait_fd (&writable);
+  PXChannel::output_t &out = chan.output ();
+  if (fd >= 0 && fd == out.wait_fd)
+    return true;
+  unwait_output (chan);
+  if (fd < 0)
+    return false;
+
+  if (outfd_ < 0)
+  {
+    outfd_ = epoll_create1 (EPOLL_CLOEXEC);
+    if (outfd_ < 0)
+      return false;
+    if (epfd_ >= 0)
+    {
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      epoll_ctl (epfd_, EPOLL_CTL_ADD, outfd_, &ev);
+    }
+  }
+
+  epoll_event ev;
+  ev.events = writable ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = &chan;
+  if (epoll_ctl (outfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return false;
+  out.wait_fd = fd;
+  ++out_waits_;
+  return true;
+}
+
+
+void
+PXDriver::unwait_output (PXChannel &chan)
+{
+  if (!chan.out_ || chan.out_->wait_fd < 0)
+    return;
+  epoll_ctl (outfd_, EPOLL_CTL_DEL, chan.out_->wait_fd, NULL);
+  chan.out_->wait_fd = -1;
+  --out_waits_;
+}
+
+
+void
+PXDriver::sync_channels (channel_list_t &dirty)
+{
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+  {
+    if (!(*ch)->dirty_)
+      continue;
+    (*ch)->dirty_ = false;
+    watch (**ch); // may have been reopened
+    dirty.push_back (*ch);
+  }
+}
+
+
+bool
+PXDriver::read_events (const timeval_t &now, channel_list_t &ready)
+{
+  // anything not picked up now leaves the epoll fd readable for the host
+  epoll_event evs[64];
+  int num = epoll_wait (epfd_, evs, 64, 0);
+  if (num < 0)
+    return errno == EINTR;
+  take_events (evs, num, now, ready);
+  return true;
+}
+
+
+void
+PXDriver::take_events (const epoll_event *evs, int num, const timeval_t &now, channel_list_t &ready)
+{
+  // commands may add or remove channels, leaving the events stale; those
+  // still readable are simply reported again
+  for (int i = 0; i < num; ++i)
+    if (evs[i].data.ptr == &wakefd_)
+    {
+      drain_wakeup ();
+      if (run_commands ())
+        num = 0;
+      break;
+    }
+
+  if (unwatched_)
+    for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+      if ((*ch)->polled_fd_ == -2)
+        read_channel (*ch, now, ready);
+
+  for (int i = 0; i < num; ++i)
+  {
+    // no channel for the wakeup fd, nor for output which can go on, as
+    // service_writes () sees to that
+    if (!evs[i].data.ptr || evs[i].data.ptr == &wakefd_)
+      continue;
+    PXChannel *chan = static_cast<PXChannel *> (evs[i].data.ptr);
+    read_channel (chan->shared_from_this (), now, ready);
+  }
+  dispatch_deferred ();
+  schedule (ready);
+}
+
+
+bool
+PXDriver::next_deadline (timeval_t *when) const
+{
+  timeval_t now;
+  gettimeofday (&now, NULL);
+  if (unwatched_)
+  {
+    *when = now;
+    return true;
+  }
+
+  timeval_t next = { INTMAX_MAX, 0 };
+  channel_list_t due;
+  find_idle (now, next, due);
+  if (!due.empty ())
+    next = now;
+  for (size_t i = 0; i < expiry_.size (); ++i)
+    if (expiry_[i] < next)
+      next = expiry_[i];
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+  {
+    if ((*ch)->write_pending () && (*ch)->out_->next_write < next)
+      next = (*ch)->out_->next_write;
+    if ((*ch)->io_->output_pending () &&
+        !((*ch)->out_ && (*ch)->out_->wait_fd >= 0))
+    {
+      timeval_t retry = now;
+      retry += io_retry;
+      if (retry < next)
+        next = retry;
+    }
+    if ((*ch)->dirty_)
+      next = now;
+  }
+  *when = next;
+  return next.tv_sec != INTMAX_MAX;
+}
+
+
+int
+PXDriver::process_events ()
+{
+  if (event_fd () < 0)
+    return -1;
+
+  events_ = 0;
+  timeval_t now;
+  gettimeofday (&now, NULL);
+
+  timeval_t wake = { INTMAX_MAX, 0 };
+  service_writes (now, wake);
+
+  // only channels with new data or new expectations need looking at
+  unchecked_.clear ();
+  run_commands ();
+  sync_channels (unchecked_);
+  if (ring_.active () ? !uring_poll (NULL, now, unchecked_) :
+      !read_events (now, unchecked_))
+    return -1;
+  find_idle (now, wake, unchecked_);
+
+  channel_id_t matched;
+  while (check_expectations (unchecked_, &matched) != PXChannel::M_NONE)
+    ;
+  expire (now, wake);
+  // programs moved along by a timeout may already have their next match
+  while (check_expectations (unchecked_, &matched) != PXChannel::M_NONE)
+    ;
+  printer_->flush ();
+  return events_;
+}
+
+
+channel_id_t
+PXDriver::post_add_channel (std::shared_ptr<PXChannel> chan)
+{
+  // the id is handed out now, the slot is filled in by the driver thread
+  channel_id_t id = slots_.reserve ();
+  command_t cmd = { C_ADD, chan, id, std::string (),
+    std::shared_ptr<PXPattern> (), { 0, 0 }, { 0, 0 }, PXSERIAL };
+  post (std::move (cmd));
+  return id;
+}
+
+
+void
+PXDriver::post_remove_channel (channel_id_t chan_id)
+{
+  command_t cmd = { C_REMOVE, std::shared_ptr<PXChannel> (), chan_id,
+    std::string (), std::shared_ptr<PXPattern> (), { 0, 0 }, { 0, 0 },
+    PXSERIAL };
+  post (std::move (cmd));
+}
+
+
+void
+PXDriver::post_write (channel_id_t chan_id, const std::string &str)
+{
+  command_t cmd = { C_WRITE, std::shared_ptr<PXChannel> (), chan_id, str,
+    std::shared_ptr<PXPattern> (), { 0, 0 }, { 0, 0 }, PXSERIAL };
+  post (std::move (cmd));
+}
+
+
+void
+PXDriver::post_expect (channel_id_t chan_id, const std::string &expr, timeval_t timeout, exp_type_t et)
+{
+  timeval_t expiry;
+  gettimeofday (&expiry, NULL);
+  expiry += timeout;
+  command_t cmd = { C_EXPECT, std::shared_ptr<PXChannel> (), chan_id,
+    std::string (), PXPattern::intern (expr),
+    timeout, expiry, et };
+  post (std::move (cmd));
+}
+
+
+void
+PXDriver::post (command_t &&cmd)
+{
+  commands_.push (std::move (cmd));
+  // one wakeup is enough until the driver thread gets round to it
+  if (!signalled_.exchange (true, std::memory_order_acq_rel) && wakefd_ >= 0)
+  {
+    uint64_t one = 1;
+    if (::write (wakefd_, &one, sizeof (one)) < 0)
+      return; // already readable
+  }
+}
+
+
+void
+PXDriver::drain_wakeup ()
+{
+  uint64_t count;
+  if (wakefd_ >= 0 && ::read (wakefd_, &count, sizeof (count)) < 0)
+    count = 0;
+}
+
+
+bool
+PXDriver::run_commands ()
+{
+  // posters only signal when the flag was clear, so once it's reset here
+  // a post racing with us either gets drained now or signals again. Its
+  // signal may come after the drain below, with nothing left to do, which
+  // is why whoever sees the wakeup fd readable drains it again.
+  if (!signalled_.exchange (false, std::memory_order_acq_rel))
+    return false;
+  drain_wakeup ();
+
+  command_t cmd = { C_WRITE, std::shared_ptr<PXChannel> (), 0, std::string (),
+    std::shared_ptr<PXPattern> (), { 0, 0 }, { 0, 0 }, PXSERIAL };
+  while (commands_.pop (cmd))
+  {
+    switch (cmd.type)
+    {
+      case C_ADD:
+        insert_channel (cmd.chan, cmd.chan_id);
+        break;
+      case C_REMOVE:
+        remove_channel (cmd.chan_id);
+        break;
+      case C_WRITE:
+      case C_EXPECT:
+      {
+        std::shared_ptr<PXChannel> chan = find_channel (cmd.chan_id);
+        if (!chan)
+          break; // removed meanwhile
+        if (cmd.type == C_WRITE)
+          chan->write (cmd.data);
+        else
+        {
+          chan->add_expect (cmd.pattern, cmd.timeout, cmd.expiry, cmd.et);
+          unchecked_.push_back (chan);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  resched_ = true;
+  return true;
+}
+
+
+bool
+PXDriver::use_uring ()
+{
+  if (!ring_.active () && !ring_.setup (256, 64, 4096))
+    return false;
+  for (auto ch = channels_.begin (); ch != channels_.end (); ++ch)
+    (*ch)->async_writes_ = (*ch)->io_->write_fd () >= 0;
+  unarmed_ = channels_;
+  return true;
+}
+
+
+bool
+PXDriver::uring_poll (const timeval_t *wake, timeval_t &now, channel_list_t &ready)
+{
+  bool timed = wake && wake->tv_sec != INTMAX_MAX;
+  const uint64_t output_token = (1 << 2) | T_WAKE;
+
+  // busy polling reaps completions without waiting for them, until spin
+  // has passed or the wait is over
+  timeval_t spin_end = now;
+  spin_end += spin_;
+  bool spinning = wake && (spin_.tv_sec || spin_.tv_usec);
+  for (;;)
+  {
+    // reads only need arming where none is in flight, e.g. after a
+    // completion or a reopen, and writes only where there is output
+    for (size_t i = 0; i < unarmed_.size (); )
+    {
+      PXChannel &chan = *unarmed_[i];
+      uring_submit (unarmed_[i]);
+      if (chan.read_token_ || chan.eof_ || chan.io_->select_fd () < 0)
+      {
+        unarmed_[i] = unarmed_.back ();
+        unarmed_.pop_back ();
+      }
+      else
+        ++i; // the ring was full, try again next time
+    }
+    for (auto ch = writers_.begin (); ch != writers_.end (); ++ch)
+      uring_submit (*ch);
+
+    if (wakefd_ >= 0 && !ring_wake_armed_)
+      ring_wake_armed_ = ring_.poll (wakefd_, T_WAKE);
+    if (out_waits_ && !ring_out_armed_)
+      ring_out_armed_ = ring_.poll (outfd_, output_token);
+
+    // the one timeout covers every channel's deadlines and paced writes, and
+    // stays armed for as long as the deadline doesn't move
+    if (wake && ring_timeout_ &&
+        (!timed || *wake < ring_deadline_ || ring_deadline_ < *wake))
+    {
+      ring_.cancel_timeout (ring_timeout_);
+      ring_timeout_ = 0;
+    }
+    if (timed && !ring_timeout_)
+    {
+      timeval_t left = { 0, 0 };
+      if (now < *wake)
+      {
+        left = *wake;
+        left -= now;
+      }
+      uint64_t token = (++ring_seq_ << 2) | T_TIMEOUT;
+      if (ring_.timeout (left, token))
+      {
+        ring_timeout_ = token;
+        ring_deadline_ = *wake;
+      }
+    }
+
+    if (ring_.enter (wake && !spinning ? 1 : 0) < 0)
+      return errno == EINTR || errno == EBUSY;
+    gettimeofday (&now, NULL);
+
+    // results of cancellations, and of timeouts which have since been
+    // replaced, are only housekeeping and don't end the wait
+    bool progress = !wake;
+    PXUring::completion_t c;
+    while (ring_.next (&c))
+    {
+      switch (c.token & 3)
+      {
+        case T_TIMEOUT:
+          if (c.token == ring_timeout_)
+          {
+            ring_timeout_ = 0;
+            progress = true;
+            if (wake && !(now < *wake))
+            {
+              timeval_t late = now;
+              late -= *wake;
+              wake_latency_.add (late);
+            }
+          }
+          break;
+        case T_WAKE:
+          if (c.token == T_WAKE)
+          {
+            ring_wake_armed_ = false;
+            drain_wakeup ();
+            run_commands ();
+            progress = true;
+          }
+          else if (c.token == output_token)
+          {
+            // service_writes () takes it from here
+            ring_out_armed_ = false;
+            progress = true;
+          }
+          break;
+        default:
+          if (c.token)
+          {
+            uring_complete (c, now, ready);
+            progress = true;
+          }
+          break;
+      }
+    }
+    if (progress)
+      break;
+    if (spinning && timed && !(now < *wake))
+    {
+      // got there before the ring's own timeout
+      timeval_t late = now;
+      late -= *wake;
+      wake_latency_.add (late);
+      break;
+    }
+    if (spinning)
+      spinning = now < spin_end;
+  }
+  dispatch_deferred ();
+  schedule (ready);
+  return true;
+}
+
+
+void
+PXDriver::uring_submit (const std::shared_ptr<PXChannel> &chan)
+{
+  // a reopened channel has a new fd, and the read on the old one has to go
+  int fd = chan->io_->select_fd ();
+  if (chan->read_token_ && chan->read_fd_ != fd)
+  {
+    ring_.cancel (chan->read_token_);
+    chan->read_token_ = 0;
+  }
+  if (!chan->eof_ && !chan->read_token_ && fd >= 0)
+  {
+    uint64_t token = (++ring_seq_ << 2) | T_READ;
+    bool raw = chan->io_->raw_reads ();
+    if (raw ? ring_.read (fd, token, multishot_) : ring_.poll (fd, token))
+    {
+      chan->read_token_ = token;
+      chan->read_fd_ = fd;
+      ring_ops_[token] = chan;
+    }
+  }
+
+  PXChannel::output_t *out = chan->out_.get ();
+  if (out && !out->write_token && !out->wq.empty ())
+  {
+    out->inflight.swap (out->wq);
+    uint64_t token = (++ring_seq_ << 2) | T_WRITE;
+    if (ring_.write (chan->io_->write_fd (), out->inflight.data (),
+        out->inflight.size (), token, chan->io_->is_socket ()))
+    {
+      out->write_token = token;
+      ring_ops_[token] = chan;
+    }
+    else
+      out->wq.swap (out->inflight);
+  }
+}
+
+
+void
+PXDriver::uring_complete (const PXUring::completion_t &c, const timeval_t &now, channel_list_t &ready)
+{
+  auto op = ring_ops_.find (c.token);
+  if (op == ring_ops_.end ())
+  {
+    ring_.recycle (c);
+    return;
+  }
+  std::shared_ptr<PXChannel> chan = op->second;
+  if (!ring_.more (c))
+    ring_ops_.erase (op);
+
+  if ((c.token & 3) == T_WRITE)
+  {
+    PXChannel::output_t *out = chan->out_.get ();
+    if (!out || out->write_token != c.token)
+      return; // removed meanwhile
+    out->write_token = 0;
+    if (c.res > 0)
+      out->inflight.erase (0, (size_t)c.res);
+    else if (c.res != -EAGAIN && c.res != -EINTR)
+      out->inflight.clear (); // nowhere for it to go
+    // whatever didn't make it goes out first next time
+    out->wq.insert (0, out->inflight);
+    out->inflight.clear ();
+    return;
+  }
+
+  // stale reads, from before a reopen or removal, are just dropped
+  bool current = chan->read_token_ == c.token;
+  if (current && !ring_.more (c))
+  {
+    chan->read_token_ = 0; // rearmed next time round
+    unarmed_.push_back (chan);
+  }
+  if (current && c.res > 0 && !chan->io_->raw_reads ())
+  {
+    // only polled, the device reads for itself
+    read_channel (chan, now, ready);
+    return;
+  }
+  if (c.res > 0)
+  {
+    if (current)
+      deliver (chan, ring_.data (c), (size_t)c.res, now, ready);
+    ring_.recycle (c);
+    return;
+  }
+  ring_.recycle (c);
+  if (!current)
+    return;
+
+  switch (-c.res)
+  {
+    case EINVAL:
+    case EBADFD:
+    case EOPNOTSUPP:
+      // no multishot reads for this kernel or file, so go single shot
+      if (multishot_)
+      {
+        multishot_ = false;
+        return;
+      }
+      channel_eof (chan);
+      break;
+    case ENOBUFS:
+    case EAGAIN:
+    case EINTR:
+    case ECANCELED:
+      break;
+    default:
+      channel_eof (chan);
+      break;
+  }
+}
+
+
+void
+PXDriver::uring_forget (PXChannel &chan)
+{
+  if (chan.read_token_)
+    ring_.cancel (chan.read_token_);
+  chan.read_token_ = 0;
+  if (chan.out_)
+    chan.out_->write_token = 0;
+}
+
+
+void
+PXDriver::set_busy_poll (timeval_t spin)
+{
+  spin_ = spin;
+}
+
+
+int
+PXDriver::pin_to_cpu (int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  CPU_SET ((size_t)cpu, &set);
+  return sched_setaffinity (0, sizeof (set), &set);
+}
+
+
+void
+PXDriver::reset_latency ()
+{
+  match_latency_.reset ();
+  wake_latency_.reset ();
+}
+
+
+} // namespace
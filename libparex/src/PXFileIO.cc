@@ -31,6 +31,7 @@
  */
 
 #include "PXFileIO.h"
+#include <unistd.h>
 #include <fcntl.h>
 
 namespace ParEx
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXFilter.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+const char ESC = 0x1b;
+const char BEL = 0x07;
+
+inline bool plain (unsigned char c)
+{
+  return c >= 0x20 || c == '\n' || c == '\t';
+}
+
+
+// Length of the run of plain text at the start of data
+size_t plain_run (const char *data, size_t len)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  // flipping the top bit makes the signed compare an unsigned one
+  const __m128i flip = _mm_set1_epi8 (static_cast<char> (0x80));
+  const __m128i low = _mm_set1_epi8 (static_cast<char> (0x20 ^ 0x80));
+  const __m128i nl = _mm_set1_epi8 ('\n');
+  const __m128i tab = _mm_set1_epi8 ('\t');
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + i));
+    __m128i ctrl = _mm_cmplt_epi8 (_mm_xor_si128 (v, flip), low);
+    __m128i ok = _mm_or_si128 (_mm_cmpeq_epi8 (v, nl), _mm_cmpeq_epi8 (v, tab));
+    int mask = _mm_movemask_epi8 (_mm_andnot_si128 (ok, ctrl));
+    if (mask)
+      return i + static_cast<size_t> (__builtin_ctz (static_cast<unsigned> (mask)));
+  }
+#endif
+  while (i < len && plain (static_cast<unsigned char> (data[i])))
+    ++i;
+  return i;
+}
+
+} // anon
+
+namespace ParEx
+{
+
+PXFilter::~PXFilter ()
+{
+  // Empty
+}
+
+
+PXAnsiFilter::PXAnsiFilter ()
+  : state_ (S_TEXT)
+{
+  // Empty
+}
+
+
+void
+PXAnsiFilter::filter (const char *data, size_t len, std::string &out)
+{
+  for (size_t i = 0; i < len; )
+  {
+    if (state_ == S_TEXT)
+    {
+      size_t n = plain_run (data + i, len - i);
+      out.append (data + i, n);
+      i += n;
+      if (i == len)
+        break;
+    }
+
+    const char c = data[i++];
+    switch (state_)
+    {
+      case S_CR:
+        if (c == '\r')
+          break; // \r\r\n, as ptys like to send
+        out += '\n';
+        state_ = S_TEXT;
+        if (c == '\n')
+          break;
+        // fall through
+      case S_TEXT:
+        if (c == ESC)
+          state_ = S_ESC;
+        else if (c == '\r')
+          state_ = S_CR;
+        else if (plain (static_cast<unsigned char> (c)))
+          out += c;
+        break; // other controls are dropped
+      case S_ESC:
+        if (c == '[')
+          state_ = S_CSI;
+        else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+          state_ = S_STRING;
+        else if (c >= 0x20 && c <= 0x2f)
+          state_ = S_ESC_INTER; // e.g. ESC ( B
+        else
+          state_ = S_TEXT;
+        break;
+      case S_ESC_INTER:
+        if (c < 0x20 || c > 0x2f)
+          state_ = S_TEXT;
+        break;
+      case S_CSI:
+        if (c >= 0x40 && c <= 0x7e)
+          state_ = S_TEXT; // parameters and intermediates are below that
+        break;
+      case S_STRING:
+        if (c == BEL)
+          state_ = S_TEXT;
+        else if (c == ESC)
+          state_ = S_STRING_ESC;
+        break;
+      case S_STRING_ESC:
+        state_ = c == '\\' ? S_TEXT : S_STRING;
+        break;
+      default:
+        state_ = S_TEXT;
+        break;
+    }
+  }
+}
+
+} // namespace
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXHistogram.h"
+
+namespace ParEx
+{
+
+const size_t PXHistogram::BUCKETS;
+
+PXHistogram::PXHistogram ()
+  : buckets_ (), count_ (0), sum_us_ (0), max_us_ (0)
+{
+  // Empty
+}
+
+
+void
+PXHistogram::add (const struct timeval &latency)
+{
+  if (latency.tv_sec < 0)
+    return; // clock went backwards
+  uint64_t us = (uint64_t)latency.tv_sec * 1000000 + (uint64_t)latency.tv_usec;
+
+  size_t b = 0;
+  for (uint64_t v = us >> 1; v && b < BUCKETS - 1; v >>= 1)
+    ++b;
+  ++buckets_[b];
+  ++count_;
+  sum_us_ += us;
+  if (us > max_us_)
+    max_us_ = us;
+}
+
+
+void
+PXHistogram::reset ()
+{
+  for (size_t b = 0; b < BUCKETS; ++b)
+    buckets_[b] = 0;
+  count_ = sum_us_ = max_us_ = 0;
+}
+
+
+uint64_t
+PXHistogram::percentile_us (unsigned pct) const
+{
+  uint64_t want = (count_ * pct + 99) / 100, seen = 0;
+  for (size_t b = 0; b < BUCKETS; ++b)
+  {
+    seen += buckets_[b];
+    if (seen >= want && seen)
+    {
+      uint64_t bound = ((uint64_t)1 << (b + 1)) - 1;
+      return bound < max_us_ ? bound : max_us_;
+    }
+  }
+  return max_us_;
+}
+
+} // namespace
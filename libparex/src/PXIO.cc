@@ -66,8 +66,8 @@ char
 PXIO::getc ()
 {
   char c;
-  ssize_t ret = read (fd_, &c, 1);
-  if (ret == 0)
+  ssize_t ret = ::read (fd_, &c, 1);
+  if (ret == 0 || (ret < 0 && errno == EIO)) // EIO: pty slave hung up
     throw PXIO::E_EOF ();
   else if (ret < 0)
     throw_errno ();
@@ -75,10 +75,20 @@ PXIO::getc ()
 }
 
 
+ssize_t
+PXIO::read (char *buf, size_t len)
+{
+  ssize_t ret = ::read (fd_, buf, len);
+  if (ret < 0 && errno == EIO) // pty slave hung up
+    ret = 0;
+  return ret;
+}
+
+
 void
 PXIO::putc (char c)
 {
-  ssize_t ret = write (fd_, &c, 1);
+  ssize_t ret = ::write (fd_, &c, 1);
   if (ret == 0)
     throw PXIO::E_AGAIN ();
   else if (ret < 0)
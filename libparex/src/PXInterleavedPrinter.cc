@@ -38,7 +38,7 @@ namespace ParEx
 {
 
 PXInterleavedPrinter::PXInterleavedPrinter (FILE *fil)
-  : bufs_ (), out_ (fil)
+  : bufs_ (), out_ (fil), prefix_ ()
 {
   // Empty
 }
@@ -48,12 +48,9 @@ PXInterleavedPrinter::~PXInterleavedPrinter ()
 {
   for_each (bufs_.begin (), bufs_.end (),
     [&](chan_buf_t &b) {
-        std::string p = line_prefix ();
-        fwrite (p.c_str (), p.size (), 1, out_);
-        const std::string &name = b.channel->name ();
-        fwrite (name.c_str (), name.size (), 1, out_);
-        fwrite ("> ", 2, 1, out_);
-        fwrite (b.buffer.c_str (), b.buffer.size (), 1, out_);
+        if (!b.chid)
+          return;
+        write_line (b, 0, b.buffer.size ());
         fwrite ("\n", 1, 1, out_); // append eol
     });
   fflush (out_);
@@ -63,29 +60,47 @@ PXInterleavedPrinter::~PXInterleavedPrinter ()
 void
 PXInterleavedPrinter::add_channel (channel_id_t chan_id, std::shared_ptr<PXChannel> channel)
 {
-  chan_buf_t buf = { chan_id, channel, "" };
-  bufs_.push_back (buf);
+  size_t idx = PXSlotMap<size_t>::index (chan_id);
+  if (idx >= bufs_.size ())
+  {
+    chan_buf_t unused = { 0, std::shared_ptr<PXChannel> (), "" };
+    bufs_.resize (idx +1, unused);
+  }
+  // a reused slot keeps the buffer storage of its previous channel
+  bufs_[idx].chid = chan_id;
+  bufs_[idx].channel = channel;
+  bufs_[idx].buffer.clear ();
 }
 
 
 void
 PXInterleavedPrinter::remove_channel (channel_id_t chan_id, std::shared_ptr<PXChannel> channel)
 {
-  // TODO: remove - the below comment no longer reflects reality
-  // We don't remove channels since that would mess up the channel indexes
-  // and yield very confusing output
-  (void)chan_id;
   (void)channel;
+  chan_buf_t *buf = find_buf (chan_id);
+  if (!buf)
+    return;
+
+  flush_buf (*buf);
+  if (!buf->buffer.empty ())
+  {
+    write_line (*buf, 0, buf->buffer.size ());
+    fwrite ("\n", 1, 1, out_); // append eol
+  }
+  fflush (out_);
+  buf->chid = 0;
+  buf->channel.reset ();
+  buf->buffer.clear ();
 }
 
 
 PXInterleavedPrinter::chan_buf_t *
 PXInterleavedPrinter::find_buf (channel_id_t chid)
 {
-  auto i = std::find_if (bufs_.begin (), bufs_.end (),
-      [=](chan_buf_t &b) { return b.chid == chid; });
-
-  return (i == bufs_.end ()) ? NULL : &*i;
+  size_t idx = PXSlotMap<size_t>::index (chid);
+  if (idx >= bufs_.size () || bufs_[idx].chid != chid || !chid)
+    return NULL;
+  return &bufs_[idx];
 }
 
 
@@ -102,18 +117,29 @@ void
 PXInterleavedPrinter::matched (channel_id_t chan_id, const std::string &str)
 {
   chan_buf_t *buf = find_buf (chan_id);
-  if (buf)
+  if (buf && !str.empty ()) // idle expectations match nothing
   {
     std::string::size_type pos = buf->buffer.rfind (str);
     if (pos != std::string::npos)
-    {
-      buf->buffer.replace (pos, str.size (), hilight_match (str));
-    }
+      mark_match (buf->buffer, pos, str.size ());
     else {} // TODO
   }
 }
 
 
+void
+PXInterleavedPrinter::aborted (channel_id_t chan_id, const std::string &str)
+{
+  chan_buf_t *buf = find_buf (chan_id);
+  if (buf)
+  {
+    std::string::size_type pos = buf->buffer.rfind (str);
+    if (pos != std::string::npos)
+      mark_abort (buf->buffer, pos, str.size ());
+  }
+}
+
+
 void
 PXInterleavedPrinter::timedout (channel_id_t chan_id, const std::string &expr, timeval_t timeout)
 {
@@ -122,7 +148,10 @@ PXInterleavedPrinter::timedout (channel_id_t chan_id, const std::string &expr, t
   {
     std::ostringstream oss;
     oss << "Timed out after " << timeout.tv_sec << "s waiting for '" << expr << "'";
-    buf->buffer += hilight_timeout (oss.str ()) + "\n";
+    size_t pos = buf->buffer.size ();
+    buf->buffer += oss.str ();
+    mark_timeout (buf->buffer, pos, buf->buffer.size () - pos);
+    buf->buffer += "\n";
   }
 }
 
@@ -131,47 +160,71 @@ void
 PXInterleavedPrinter::flush ()
 {
   for_each (bufs_.begin (), bufs_.end (),
-    [&](chan_buf_t &b) {
-      std::string::size_type pos = b.buffer.find ('\n');
-      while (pos != std::string::npos)
-      {
-        std::string p = line_prefix ();
-        fwrite (p.c_str (), p.size (), 1, out_);
-        const std::string &name = b.channel->name ();
-        fwrite (name.c_str (), name.size (), 1, out_);
-        fwrite ("> ", 2, 1, out_);
-        fwrite (b.buffer.c_str (), pos +1, 1, out_);
-
-        b.buffer = b.buffer.substr (pos +1);
-
-        pos = b.buffer.find ('\n');
-      }
-    });
+    [&](chan_buf_t &b) { flush_buf (b); });
   fflush (out_);
 }
 
 
-std::string
-PXInterleavedPrinter::line_prefix () const
+void
+PXInterleavedPrinter::flush_buf (chan_buf_t &b)
+{
+  // whole lines only, and the buffer is trimmed once at the end
+  std::string::size_type done = 0;
+  std::string::size_type pos = b.buffer.find ('\n');
+  while (pos != std::string::npos)
+  {
+    write_line (b, done, pos +1 - done);
+    done = pos +1;
+    pos = b.buffer.find ('\n', done);
+  }
+  b.buffer.erase (0, done);
+}
+
+
+void
+PXInterleavedPrinter::write_line (const chan_buf_t &b, size_t from, size_t len)
+{
+  format_prefix (prefix_);
+  fwrite (prefix_.c_str (), prefix_.size (), 1, out_);
+  const std::string &name = b.channel->name ();
+  fwrite (name.c_str (), name.size (), 1, out_);
+  fwrite ("> ", 2, 1, out_);
+  fwrite (b.buffer.c_str () + from, len, 1, out_);
+}
+
+
+void
+PXInterleavedPrinter::format_prefix (std::string &prefix) const
 {
   time_t now = time (NULL);
+  struct tm tm;
   char buf[40];
-  strftime (buf, sizeof (buf), "\033[1m[%T]\033[0m ", localtime (&now));
-  return buf;
+  strftime (buf, sizeof (buf), "\033[1m[%T]\033[0m ", localtime_r (&now, &tm));
+  prefix.assign (buf);
+}
+
+
+void
+PXInterleavedPrinter::mark_match (std::string &buf, size_t pos, size_t len) const
+{
+  buf.insert (pos + len, "\033[0m");
+  buf.insert (pos, "\033[34m");
 }
 
 
-std::string
-PXInterleavedPrinter::hilight_match (const std::string &str) const
+void
+PXInterleavedPrinter::mark_timeout (std::string &buf, size_t pos, size_t len) const
 {
-  return "\033[34m" + str + "\033[0m";
+  buf.insert (pos + len, "\033[0m");
+  buf.insert (pos, "\033[31m");
 }
 
 
-std::string
-PXInterleavedPrinter::hilight_timeout (const std::string &str) const
+void
+PXInterleavedPrinter::mark_abort (std::string &buf, size_t pos, size_t len) const
 {
-  return "\033[31m" + str + "\033[0m";
+  buf.insert (pos + len, "\033[0m");
+  buf.insert (pos, "\033[1;31m");
 }
 
 } // namespace
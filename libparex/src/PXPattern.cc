@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXPattern.h"
+#include <pcre.h>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+namespace ParEx
+{
+
+PXPattern::PXPattern (const std::string &expr)
+  : expr_ (expr), re_ (NULL), names_ ()
+{
+  const char *err = NULL;
+  int erroffset = 0;
+  re_ = pcre_compile (
+    expr_.c_str (),
+    PCRE_MULTILINE | PCRE_NEWLINE_ANY | PCRE_NO_AUTO_CAPTURE,
+    &err, &erroffset, NULL);
+  if (!re_)
+  {
+    fprintf(stderr, "invalid regex '%s' (at %d): %s\n",
+      expr_.c_str (), erroffset, err);
+    throw E_REGEX ();
+  }
+
+  // name table entries are a big-endian group number, then the name
+  int count = 0, names = 0, entry = 0;
+  const unsigned char *table = NULL;
+  pcre *re = static_cast<pcre *> (re_);
+  if (pcre_fullinfo (re, NULL, PCRE_INFO_CAPTURECOUNT, &count) == 0 && count > 0 &&
+      pcre_fullinfo (re, NULL, PCRE_INFO_NAMECOUNT, &names) == 0 &&
+      pcre_fullinfo (re, NULL, PCRE_INFO_NAMEENTRYSIZE, &entry) == 0 &&
+      pcre_fullinfo (re, NULL, PCRE_INFO_NAMETABLE, &table) == 0)
+  {
+    names_.resize (static_cast<size_t> (count));
+    for (int i = 0; i < names; ++i, table += entry)
+    {
+      size_t n = static_cast<size_t> ((table[0] << 8) | table[1]);
+      if (n >= 1 && n <= names_.size ())
+        names_[n - 1] = reinterpret_cast<const char *> (table + 2);
+    }
+  }
+}
+
+
+std::shared_ptr<PXPattern>
+PXPattern::intern (const std::string &expr)
+{
+  typedef std::map<std::string, std::shared_ptr<PXPattern> > table_t;
+  static const size_t sweep_at = 1024;
+  static table_t table;
+  static size_t limit = sweep_at;
+  static std::mutex lock;
+
+  std::lock_guard<std::mutex> guard (lock);
+  auto i = table.find (expr);
+  if (i != table.end ())
+    return i->second;
+
+  if (table.size () >= limit)
+  {
+    for (auto j = table.begin (); j != table.end (); )
+      if (j->second.use_count () == 1)
+        table.erase (j++);
+      else
+        ++j;
+    // if they're all in use, don't sweep again until it has doubled
+    limit = std::max (sweep_at, 2 * table.size ());
+  }
+
+  std::shared_ptr<PXPattern> p (new PXPattern (expr));
+  table[expr] = p;
+  return p;
+}
+
+
+PXPattern::~PXPattern ()
+{
+  pcre_free (re_);
+}
+
+
+bool
+PXPattern::match (const std::string &buf, size_t *start, size_t *end) const
+{
+  return match (buf, 0, buf.size (), start, end);
+}
+
+
+bool
+PXPattern::match (const std::string &buf, size_t from, size_t to, size_t *start, size_t *end) const
+{
+  unsigned m[3];
+  int num = pcre_exec (
+    static_cast<pcre *>(re_), NULL,
+    buf.c_str (), static_cast<int> (to), static_cast<int> (from),
+    PCRE_NOTEMPTY | PCRE_NOTEOL,
+    (int *)m,
+    3);
+  if (num < 0) // 0 is a match with groups we didn't ask for
+    return false;
+
+  *start = m[0];
+  *end = m[1];
+  return true;
+}
+
+
+bool
+PXPattern::could_match (const std::string &buf) const
+{
+  int m[3];
+  int num = pcre_exec (
+    static_cast<pcre *>(re_), NULL,
+    buf.c_str (), static_cast<int> (buf.size ()), 0,
+    PCRE_ANCHORED | PCRE_NOTEMPTY | PCRE_NOTEOL | PCRE_PARTIAL_SOFT,
+    m,
+    3);
+  return num >= 0 || num == PCRE_ERROR_PARTIAL;
+}
+
+
+bool
+PXPattern::match (const std::string &buf, size_t from, size_t to, size_t *start, size_t *end, group_list_t &groups) const
+{
+  // the usual handful of groups fits on the stack, more go to the heap
+  static const size_t fixed = 3 * 16;
+  const size_t size = 3 * (names_.size () + 1);
+  int fixed_m[fixed];
+  std::vector<int> more (size > fixed ? size : 0);
+  int *m = size > fixed ? more.data () : fixed_m;
+  int num = pcre_exec (
+    static_cast<pcre *>(re_), NULL,
+    buf.c_str (), static_cast<int> (to), static_cast<int> (from),
+    PCRE_NOTEMPTY | PCRE_NOTEOL,
+    m,
+    static_cast<int> (size));
+  if (num < 0)
+    return false;
+
+  *start = static_cast<size_t> (m[0]);
+  *end = static_cast<size_t> (m[1]);
+  groups.resize (2 * names_.size ());
+  for (size_t i = 0; i < names_.size (); ++i)
+  {
+    bool set = static_cast<int> (i) + 1 < num && m[2 * i + 2] >= 0;
+    groups[2 * i] = set ? static_cast<size_t> (m[2 * i + 2]) : std::string::npos;
+    groups[2 * i + 1] = set ? static_cast<size_t> (m[2 * i + 3]) : std::string::npos;
+  }
+  return true;
+}
+
+
+size_t
+PXPattern::group (const std::string &name) const
+{
+  for (size_t i = 0; i < names_.size (); ++i)
+    if (names_[i] == name)
+      return i + 1;
+  return 0;
+}
+
+} // namespace
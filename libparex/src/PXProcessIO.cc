@@ -39,6 +39,8 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <algorithm>
 
 #include <iostream>
 
@@ -51,6 +53,96 @@ void reaper (int)
   waitpid (-1, &status, WNOHANG);
 }
 
+
+void exec_cmdline (const ParEx::argv_t &cmdline)
+{
+  const size_t argc = cmdline.size ();
+  char *argv[argc +1];
+  memset (argv, 0, sizeof (const char *) * (argc + 1));
+
+  for (size_t i = 0; i < cmdline.size (); ++i)
+    argv[i] = const_cast<char *> (cmdline[i].c_str ());
+
+  execvp (argv[0], argv);
+  exit (1); // We shouldn't get here...
+}
+
+
+// Big enough to hold a good burst of output between driver passes. Capped
+// by /proc/sys/fs/pipe-max-size for unprivileged users, in which case we
+// live with the default.
+const int pipe_size = 1 << 20;
+
+void enlarge_pipe (int fd)
+{
+  (void)fcntl (fd, F_SETPIPE_SZ, pipe_size);
+}
+
+
+void make_tee_pipe (int log, int &tee_r, int &tee_w)
+{
+  tee_r = tee_w = -1;
+  if (log < 0)
+    return;
+
+  int p[2];
+  if (pipe2 (p, O_CLOEXEC) < 0)
+    return;
+  enlarge_pipe (p[1]);
+  tee_r = p[0];
+  tee_w = p[1];
+}
+
+
+void close_tee_pipe (int &tee_r, int &tee_w)
+{
+  if (tee_r >= 0)
+    close (tee_r);
+  if (tee_w >= 0)
+    close (tee_w);
+  tee_r = tee_w = -1;
+}
+
+
+// Duplicates whatever is waiting in the pipe into the log, without
+// consuming it, and caps len to what was duplicated so the caller's read
+// stays in step with the log. Returns 0 on EOF, -1 with errno set if
+// there's nothing to read, else 1. If the log can't keep up, i.e. it would
+// block, e.g. a pipe or a terminal, logging is switched off rather than
+// stalling the channel.
+ssize_t tee_to_log (int fd, int &tee_r, int &tee_w, size_t &len, int log)
+{
+  if (tee_r < 0)
+    return 1;
+
+  ssize_t n = tee (fd, tee_w, len, SPLICE_F_NONBLOCK);
+  if (n == 0)
+    return 0;
+  if (n < 0)
+  {
+    if (errno == EAGAIN)
+      return -1;
+    close_tee_pipe (tee_r, tee_w);
+    return 1;
+  }
+
+  for (ssize_t left = n; left > 0; )
+  {
+    ssize_t m = splice (tee_r, NULL, log, NULL, static_cast<size_t> (left),
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m <= 0)
+    {
+      close_tee_pipe (tee_r, tee_w);
+      break;
+    }
+    left -= m;
+  }
+  len = static_cast<size_t> (n);
+  return 1;
+}
+
 } // anon
 
 namespace ParEx
@@ -137,15 +229,197 @@ PXProcessIO::do_open ()
     cfmakeraw (&tios);
     tcsetattr (sfd, TCSANOW, &tios);
 
-    const size_t argc = cmdline_.size ();
-    char *argv[argc +1];
-    memset (argv, 0, sizeof (const char *) * (argc + 1));
+    exec_cmdline (cmdline_);
+  }
+}
+
+
+PXPipeStream::PXPipeStream (int fd, int log)
+  : PXIO (fd), log_ (log), tee_r_ (-1), tee_w_ (-1)
+{
+  make_tee_pipe (log_, tee_r_, tee_w_);
+}
+
+
+PXPipeStream::~PXPipeStream ()
+{
+  close_tee_pipe (tee_r_, tee_w_);
+  if (log_ >= 0)
+    close (log_);
+}
+
+
+ssize_t
+PXPipeStream::read (char *buf, size_t len)
+{
+  ssize_t ret = tee_to_log (fd_, tee_r_, tee_w_, len, log_);
+  return ret > 0 ? PXIO::read (buf, len) : ret;
+}
+
+
+void
+PXPipeStream::putc (char)
+{
+  throw PXIO::E_ERR ();
+}
+
+
+void
+PXPipeStream::reopen ()
+{
+  // Empty - the owning PXPipeIO hands us a new pipe when it reopens
+}
+
+
+void
+PXPipeStream::replace (int fd, int log)
+{
+  close (fd_);
+  fd_ = fd;
+  close_tee_pipe (tee_r_, tee_w_);
+  if (log_ >= 0)
+    close (log_);
+  log_ = log;
+  make_tee_pipe (log_, tee_r_, tee_w_);
+}
+
+
+PXPipeIO::PXPipeIO (const argv_t &cmdline, bool separate_stderr, const std::string &logfile)
+  : PXIO (-1), cmdline_ (cmdline), separate_ (separate_stderr),
+    logfile_ (logfile), child_ (-1), in_ (-1), log_ (-1), tee_r_ (-1),
+    tee_w_ (-1), err_ ()
+{
+  signal (SIGCHLD, reaper);
+  do_open ();
+}
+
+
+PXPipeIO::~PXPipeIO ()
+{
+  do_close ();
+}
+
+
+ssize_t
+PXPipeIO::read (char *buf, size_t len)
+{
+  ssize_t ret = tee_to_log (fd_, tee_r_, tee_w_, len, log_);
+  return ret > 0 ? PXIO::read (buf, len) : ret;
+}
+
+
+void
+PXPipeIO::putc (char c)
+{
+  ssize_t ret = ::write (in_, &c, 1);
+  if (ret == 0 || (ret < 0 && errno == EAGAIN))
+    throw PXIO::E_AGAIN ();
+  else if (ret < 0 && errno == EINTR)
+    throw PXIO::E_INTR ();
+  else if (ret < 0)
+    throw PXIO::E_ERR ();
+}
+
+
+void
+PXPipeIO::reopen ()
+{
+  do_close ();
+  do_open ();
+}
+
+
+void
+PXPipeIO::do_close ()
+{
+  if (child_ > 0)
+    kill (child_, SIGTERM);
+  child_ = -1;
 
-    for (size_t i = 0; i < cmdline_.size (); ++i)
-      argv[i] = const_cast<char *> (cmdline_[i].c_str ());
+  close (fd_);
+  close (in_);
+  fd_ = in_ = -1;
+  close_tee_pipe (tee_r_, tee_w_);
+  if (log_ >= 0)
+    close (log_);
+  log_ = -1;
+}
+
+
+void
+PXPipeIO::do_open ()
+{
+  // [0] is always the child's end
+  int in[2], out[2], err[2] = { -1, -1 };
+  if (pipe2 (in, O_CLOEXEC) < 0)
+    throw PXIO::E_ERR ();
+  if (pipe2 (out, O_CLOEXEC) < 0)
+  {
+    close (in[0]); close (in[1]);
+    throw PXIO::E_ERR ();
+  }
+  std::swap (out[0], out[1]);
+  if (separate_ && pipe2 (err, O_CLOEXEC) < 0)
+  {
+    close (in[0]); close (in[1]); close (out[0]); close (out[1]);
+    throw PXIO::E_ERR ();
+  }
+  std::swap (err[0], err[1]);
+
+  pid_t npid = fork ();
+  if (npid == -1)
+  {
+    for (int fd : { in[0], in[1], out[0], out[1], err[0], err[1] })
+      if (fd >= 0)
+        close (fd);
+    throw PXIO::E_ERR ();
+  }
+
+  if (npid > 0) // parent
+  {
+    close (in[0]);
+    close (out[0]);
+    fcntl (in[1], F_SETFL, O_NONBLOCK);
+    fcntl (out[1], F_SETFL, O_NONBLOCK);
+    enlarge_pipe (out[1]);
+    fd_ = out[1];
+    in_ = in[1];
+    child_ = npid;
+
+    // splice () refuses O_APPEND targets, so the log is appended to by
+    // hand, and keeps what came before a reopen ()
+    if (!logfile_.empty ())
+    {
+      log_ = open (logfile_.c_str (), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+      if (log_ >= 0)
+        lseek (log_, 0, SEEK_END);
+      make_tee_pipe (log_, tee_r_, tee_w_);
+    }
+
+    if (separate_)
+    {
+      close (err[0]);
+      fcntl (err[1], F_SETFL, O_NONBLOCK);
+      enlarge_pipe (err[1]);
+      // a log of its own, as the stream may outlive us, but the same file
+      // position, so the two stay interleaved in the log
+      int errlog = log_ >= 0 ? fcntl (log_, F_DUPFD_CLOEXEC, 0) : -1;
+      if (err_)
+        err_->replace (err[1], errlog);
+      else
+        err_.reset (new PXPipeStream (err[1], errlog));
+    }
+  }
+  else // child
+  {
+    setsid ();
+
+    dup2 (in[0], STDIN_FILENO);
+    dup2 (out[0], STDOUT_FILENO);
+    dup2 (separate_ ? err[0] : out[0], STDERR_FILENO);
+    // Note: original FDs closed on exec
 
-    execvp (argv[0], argv);
-    exit (1); // We shouldn't get here...
+    exec_cmdline (cmdline_);
   }
 }
 
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXProgram.h"
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+using namespace ParEx;
+
+typedef std::vector<std::string> words_t;
+
+// Splits a line into words, honouring double quotes and '#' comments
+bool
+split_words (const std::string &line, words_t &words)
+{
+  std::string word;
+  bool inword = false, inquote = false;
+  for (size_t i = 0; i < line.size (); ++i)
+  {
+    char c = line[i];
+    if (inquote)
+    {
+      if (c == '"')
+        inquote = false;
+      else if (c == '\\' && i +1 < line.size ())
+      {
+        char n = line[++i];
+        switch (n)
+        {
+          case 'n': word += '\n'; break;
+          case 'r': word += '\r'; break;
+          case 't': word += '\t'; break;
+          case 'e': word += '\033'; break;
+          case '"': word += '"'; break;
+          case '\\': word += '\\'; break;
+          default: word += c; word += n; break; // leave for the regex
+        }
+      }
+      else
+        word += c;
+      continue;
+    }
+
+    if (c == '#')
+      break;
+    if (c == ' ' || c == '\t' || c == '\r')
+    {
+      if (inword)
+        words.push_back (word);
+      word.clear ();
+      inword = false;
+      continue;
+    }
+    inword = true;
+    if (c == '"')
+      inquote = true;
+    else
+      word += c;
+  }
+  if (inword)
+    words.push_back (word);
+  return !inquote;
+}
+
+
+void
+syntax_error (size_t line)
+{
+  fprintf (stderr, "invalid program (at line %zu)\n", line);
+  PXProgram::E_SYNTAX e = { line };
+  throw e;
+}
+
+
+bool
+to_timeval (const std::string &str, double scale, timeval_t *tv)
+{
+  char *end = NULL;
+  double d = strtod (str.c_str (), &end) * scale;
+  if (str.empty () || *end || d < 0)
+    return false;
+  tv->tv_sec = static_cast<time_t> (d);
+  tv->tv_usec = static_cast<suseconds_t> ((d - static_cast<double> (tv->tv_sec)) * 1e6);
+  return true;
+}
+
+} // anon
+
+namespace ParEx
+{
+
+const size_t PXProgram::npos;
+
+PXProgram::PXProgram (const std::string &text)
+  : steps_ ()
+{
+  // labels may be used before they're defined, so resolve them at the end
+  typedef struct {
+    size_t step;
+    size_t branch; // or npos for the timeout/goto target
+    std::string label;
+    size_t line;
+  } fixup_t;
+  std::vector<fixup_t> fixups;
+  std::map<std::string, size_t> labels;
+
+  size_t lineno = 0;
+  std::string::size_type pos = 0;
+  while (pos < text.size ())
+  {
+    std::string::size_type eol = text.find ('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size ();
+    std::string line = text.substr (pos, eol - pos);
+    pos = eol +1;
+    ++lineno;
+
+    words_t w;
+    if (!split_words (line, w))
+      syntax_error (lineno);
+
+    if (!w.empty () && w[0].size () > 1 && *w[0].rbegin () == ':')
+    {
+      std::string label = w[0].substr (0, w[0].size () -1);
+      if (labels.count (label))
+        syntax_error (lineno);
+      labels[label] = steps_.size ();
+      w.erase (w.begin ());
+    }
+    if (w.empty ())
+      continue;
+
+    step_t s;
+    size_t idx = steps_.size ();
+    size_t args = 0;
+    if (w[0] == "expect" && w.size () >= 3)
+    {
+      s.op = OP_EXPECT;
+      if (!to_timeval (w[1], 1, &s.timeout))
+        syntax_error (lineno);
+      branch_t first = { PXPattern::intern (w[2]), idx +1 };
+      s.branches.push_back (first);
+      args = 3;
+    }
+    else if (w[0] == "idle" && w.size () >= 3)
+    {
+      s.op = OP_IDLE;
+      if (!to_timeval (w[1], 1e-3, &s.idle) || !to_timeval (w[2], 1, &s.timeout))
+        syntax_error (lineno);
+      args = 3;
+    }
+    else if (w[0] == "send" && w.size () == 2)
+    {
+      s.op = OP_SEND;
+      s.data = w[1];
+      args = 2;
+    }
+    else if (w[0] == "goto" && w.size () == 2)
+    {
+      s.op = OP_GOTO;
+      fixup_t f = { idx, npos, w[1], lineno };
+      fixups.push_back (f);
+      args = 2;
+    }
+    else if (w[0] == "done" && w.size () == 1)
+    {
+      s.op = OP_DONE;
+      args = 1;
+    }
+    else if (w[0] == "fail" && w.size () == 1)
+    {
+      s.op = OP_FAIL;
+      args = 1;
+    }
+    else
+      syntax_error (lineno);
+
+    // trailing "<regex> <label>" branches and "else <label>"
+    while (args < w.size ())
+    {
+      if (args +1 >= w.size ())
+        syntax_error (lineno);
+      if (w[args] == "else")
+      {
+        fixup_t f = { idx, npos, w[args +1], lineno };
+        fixups.push_back (f);
+      }
+      else if (s.op == OP_EXPECT)
+      {
+        branch_t b = { PXPattern::intern (w[args]), npos };
+        fixup_t f = { idx, s.branches.size (), w[args +1], lineno };
+        s.branches.push_back (b);
+        fixups.push_back (f);
+      }
+      else
+        syntax_error (lineno);
+      args += 2;
+    }
+    steps_.push_back (s);
+  }
+
+  for (auto f = fixups.begin (); f != fixups.end (); ++f)
+  {
+    auto l = labels.find (f->label);
+    if (l == labels.end ())
+    {
+      fprintf (stderr, "unknown label '%s'\n", f->label.c_str ());
+      syntax_error (f->line);
+    }
+    step_t &s = steps_[f->step];
+    if (f->branch != npos)
+      s.branches[f->branch].target = l->second;
+    else if (s.op == OP_GOTO)
+      s.target = l->second;
+    else
+      s.on_timeout = l->second;
+  }
+}
+
+} // namespace
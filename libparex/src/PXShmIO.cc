@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXShmIO.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+namespace ParEx
+{
+
+PXShmIO::PXShmIO (uint32_t size)
+  : PXIO (-1), hdr_ (NULL), map_size_ (0), memfd_ (-1), tx_bell_ (-1),
+    space_bell_ (-1), bell_due_ (false), pending_ ()
+{
+  uint32_t ring = 4096;
+  while (ring < size && ring < (1u << 30))
+    ring <<= 1;
+  map_size_ = px_shm_mapping_size (ring);
+
+  // no CLOEXEC on any of these, the simulator needs them
+  memfd_ = memfd_create ("parex-shm", 0);
+  fd_ = eventfd (0, EFD_NONBLOCK);
+  tx_bell_ = eventfd (0, EFD_NONBLOCK);
+  space_bell_ = eventfd (0, EFD_NONBLOCK);
+  void *p = MAP_FAILED;
+  if (memfd_ >= 0 && fd_ >= 0 && tx_bell_ >= 0 && space_bell_ >= 0 &&
+      ftruncate (memfd_, static_cast<off_t> (map_size_)) == 0)
+    p = mmap (NULL, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+  if (p == MAP_FAILED)
+  {
+    close (memfd_);
+    close (tx_bell_);
+    close (space_bell_);
+    throw PXIO::E_ERR ();
+  }
+
+  hdr_ = static_cast<px_shm_header_t *> (p);
+  hdr_->size = ring;
+  __atomic_store_n (&hdr_->magic, PX_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+PXShmIO::~PXShmIO ()
+{
+  munmap (hdr_, map_size_);
+  close (memfd_);
+  close (tx_bell_);
+  close (space_bell_);
+}
+
+
+ssize_t
+PXShmIO::read (char *buf, size_t len)
+{
+  size_t n = px_shm_take (hdr_, &hdr_->rx, fd_, -1, buf, len);
+  if (n == 0)
+  {
+    errno = EAGAIN; // 0 would mean EOF, which a ring never sees
+    return -1;
+  }
+  return static_cast<ssize_t> (n);
+}
+
+
+void
+PXShmIO::putc (char c)
+{
+  if (!pending_.empty () || px_shm_put (hdr_, &hdr_->tx, &c, 1) == 0)
+    pending_ += c;
+  bell_due_ = true;
+}
+
+
+void
+PXShmIO::flush ()
+{
+  // one doorbell per batch of output, not per character
+  if (!pending_.empty ())
+  {
+    uint64_t count;
+    if (::read (space_bell_, &count, sizeof (count)) < 0)
+      count = 0;
+    for (;;)
+    {
+      size_t n = px_shm_put (hdr_, &hdr_->tx, pending_.data (), pending_.size ());
+      pending_.erase (0, n);
+      bell_due_ = bell_due_ || n > 0;
+      // still full, so the device is to ring once it has made room
+      if (pending_.empty () || px_shm_want_space (hdr_, &hdr_->tx) == 0)
+        break;
+    }
+  }
+  if (bell_due_)
+    px_shm_ring_bell (tx_bell_);
+  bell_due_ = false;
+}
+
+
+void
+PXShmIO::reopen ()
+{
+  // Empty - there's nothing to reconnect, the simulator attaches itself
+}
+
+
+int
+PXShmIO::output_wait_fd (bool *writable) const
+{
+  *writable = false;
+  return pending_.empty () ? -1 : space_bell_;
+}
+
+
+std::string
+PXShmIO::attach_spec () const
+{
+  return std::to_string (memfd_) + "," + std::to_string (fd_) + "," +
+    std::to_string (tx_bell_) + "," + std::to_string (space_bell_);
+}
+
+} // namespace
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXSocketIO.h"
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace ParEx
+{
+
+// big enough to soak up a burst of boot logs between driver iterations
+static const int rcvbuf = 1 << 20;
+
+PXSocketIO::PXSocketIO (const std::string &host, uint16_t port)
+  : PXIO (-1), host_ (host), port_ (port),
+    connecting_ (false), pending_ ()
+{
+  fd_ = connect ();
+}
+
+
+PXSocketIO::PXSocketIO (const std::string &path)
+  : PXIO (-1), host_ (path), port_ (0),
+    connecting_ (false), pending_ ()
+{
+  fd_ = connect ();
+}
+
+
+void
+PXSocketIO::reopen ()
+{
+  int fd = connect ();
+  close (fd_);
+  fd_ = fd;
+  pending_.clear ();
+}
+
+
+// A non-blocking socket, connected or on its way there, or -1 if the
+// connect failed straight away
+static int
+connect_to (const struct sockaddr *addr, socklen_t addrlen, bool *connecting)
+{
+  int fd = socket (addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // consoles are interactive, and can be chatty
+  int on = 1;
+  if (addr->sa_family != AF_UNIX)
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+  setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+  *connecting = false;
+  if (::connect (fd, addr, addrlen) < 0)
+  {
+    if (errno != EINPROGRESS && errno != EAGAIN)
+    {
+      close (fd);
+      return -1;
+    }
+    *connecting = true;
+  }
+  return fd;
+}
+
+
+int
+PXSocketIO::connect ()
+{
+  int fd = -1;
+  if (port_)
+  {
+    // a name may have several addresses, e.g. both IPv6 and IPv4 ones for
+    // localhost, so go down the list until one doesn't refuse outright
+    struct addrinfo hints, *res = NULL;
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (host_.c_str (), std::to_string (port_).c_str (), &hints, &res) != 0)
+      throw E_ERR ();
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next)
+      fd = connect_to (ai->ai_addr, ai->ai_addrlen, &connecting_);
+    freeaddrinfo (res);
+  }
+  else
+  {
+    struct sockaddr_un sun;
+    if (host_.size () >= sizeof (sun.sun_path))
+      throw E_ERR ();
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    strcpy (sun.sun_path, host_.c_str ());
+    fd = connect_to (reinterpret_cast<struct sockaddr *> (&sun), sizeof (sun), &connecting_);
+  }
+  if (fd < 0)
+    throw E_ERR ();
+  return fd;
+}
+
+
+bool
+PXSocketIO::connected ()
+{
+  if (!connecting_)
+    return true;
+  struct pollfd p = { fd_, POLLOUT, 0 };
+  if (poll (&p, 1, 0) <= 0)
+    return false;
+  // whether it worked or not, a failure shows up on the next read
+  connecting_ = false;
+  return true;
+}
+
+
+void
+PXSocketIO::putc (char c)
+{
+  // sent by the driver's flush (), a whole write at a time rather than a
+  // segment per character
+  pending_ += c;
+}
+
+
+void
+PXSocketIO::flush ()
+{
+  if (pending_.empty () || !connected ())
+    return;
+
+  ssize_t ret = send (fd_, pending_.data (), pending_.size (), MSG_NOSIGNAL);
+  if (ret > 0)
+    pending_.erase (0, (size_t)ret);
+  else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+    pending_.clear (); // the peer is gone, which reads will report
+}
+
+
+int
+PXSocketIO::output_wait_fd (bool *writable) const
+{
+  // writable once connected, or once there's room in the socket buffer
+  *writable = true;
+  return pending_.empty () ? -1 : fd_;
+}
+
+} // namespace
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PXUring.h"
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define PX_HAVE_URING 1
+# endif
+#endif
+
+#ifdef PX_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// newer than some of the headers we may be built against
+static const uint8_t OP_READ_MULTISHOT = 49;
+static const unsigned REGISTER_PBUF_RING = 22;
+#endif
+
+namespace ParEx
+{
+
+PXUring::PXUring ()
+  : fd_ (-1), ring_ (NULL), ring_size_ (0), sqes_ (NULL), sqes_size_ (0),
+    sq_head_ (NULL), sq_tail_ (NULL), sq_array_ (NULL), cq_head_ (NULL),
+    cq_tail_ (NULL), sq_mask_ (0), sq_entries_ (0), cq_mask_ (0),
+    cqes_ (NULL), pending_ (0), bufring_ (NULL), bufmem_ (NULL), nbufs_ (0),
+    buf_size_ (0), buf_tail_ (0), ts_ (NULL)
+{
+  // Empty
+}
+
+
+PXUring::~PXUring ()
+{
+  teardown ();
+}
+
+
+#ifdef PX_HAVE_URING
+
+bool
+PXUring::setup (unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+  if (fd_ >= 0)
+    return true;
+
+  io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  fd_ = (int)syscall (__NR_io_uring_setup, entries, &p);
+  if (fd_ < 0)
+    return false;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP))
+  {
+    teardown ();
+    return false;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof (io_uring_cqe);
+  ring_size_ = sq_size > cq_size ? sq_size : cq_size;
+  ring_ = mmap (NULL, ring_size_, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  sqes_size_ = p.sq_entries * sizeof (io_uring_sqe);
+  sqes_ = mmap (NULL, sqes_size_, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+  {
+    teardown ();
+    return false;
+  }
+
+  char *r = static_cast<char *> (ring_);
+  sq_head_ = reinterpret_cast<unsigned *> (r + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *> (r + p.sq_off.tail);
+  sq_array_ = reinterpret_cast<unsigned *> (r + p.sq_off.array);
+  sq_mask_ = *reinterpret_cast<unsigned *> (r + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  cq_head_ = reinterpret_cast<unsigned *> (r + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *> (r + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *> (r + p.cq_off.ring_mask);
+  cqes_ = r + p.cq_off.cqes;
+  ts_ = new struct timespec[sq_entries_];
+
+  // provided buffer ring, group 0
+  nbufs_ = nbufs;
+  buf_size_ = buf_size;
+  bufring_ = mmap (NULL, nbufs_ * sizeof (io_uring_buf),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufring_ == MAP_FAILED)
+  {
+    bufring_ = NULL;
+    teardown ();
+    return false;
+  }
+  bufmem_ = new char[(size_t)nbufs_ * buf_size_];
+
+  io_uring_buf_reg reg;
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = reinterpret_cast<uintptr_t> (bufring_);
+  reg.ring_entries = nbufs_;
+  reg.bgid = 0;
+  if (syscall (__NR_io_uring_register, fd_, REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    teardown ();
+    return false;
+  }
+  for (unsigned b = 0; b < nbufs_; ++b)
+    add_buffer (b);
+  return true;
+}
+
+
+void
+PXUring::teardown ()
+{
+  if (ring_ && ring_ != MAP_FAILED)
+    munmap (ring_, ring_size_);
+  if (sqes_ && sqes_ != MAP_FAILED)
+    munmap (sqes_, sqes_size_);
+  if (bufring_)
+    munmap (bufring_, nbufs_ * sizeof (io_uring_buf));
+  delete [] bufmem_;
+  delete [] ts_;
+  if (fd_ >= 0)
+    close (fd_);
+  fd_ = -1;
+  ring_ = sqes_ = bufring_ = NULL;
+  bufmem_ = NULL;
+  ts_ = NULL;
+}
+
+
+void
+PXUring::add_buffer (unsigned bid)
+{
+  io_uring_buf *bufs = static_cast<io_uring_buf *> (bufring_);
+  io_uring_buf &b = bufs[buf_tail_ & (nbufs_ - 1)];
+  b.addr = reinterpret_cast<uintptr_t> (bufmem_ + (size_t)bid * buf_size_);
+  b.len = buf_size_;
+  b.bid = (uint16_t)bid;
+  ++buf_tail_;
+  // the tail overlays the reserved field of the first entry
+  io_uring_buf_ring *br = static_cast<io_uring_buf_ring *> (bufring_);
+  __atomic_store_n (&br->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+
+void *
+PXUring::get_sqe ()
+{
+  unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n (sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+  {
+    // full, so get what we have off to the kernel first
+    if (enter (0) < 0 ||
+        tail - __atomic_load_n (sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return NULL;
+  }
+  unsigned idx = tail & sq_mask_;
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (sqes_) + idx;
+  memset (sqe, 0, sizeof (*sqe));
+  sq_array_[idx] = idx;
+  __atomic_store_n (sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++pending_;
+  return sqe;
+}
+
+
+bool
+PXUring::read (int fd, uint64_t token, bool multishot)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  sqe->opcode = multishot ? OP_READ_MULTISHOT : (uint8_t)IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = (uint64_t)-1; // current position
+  sqe->len = multishot ? 0 : buf_size_;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = token;
+  return true;
+}
+
+
+bool
+PXUring::write (int fd, const char *data, size_t len, uint64_t token, bool socket)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  sqe->fd = fd;
+  if (socket)
+  {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->off = (uint64_t)-1;
+  }
+  sqe->addr = reinterpret_cast<uintptr_t> (data);
+  sqe->len = (uint32_t)len;
+  sqe->user_data = token;
+  return true;
+}
+
+
+bool
+PXUring::poll (int fd, uint64_t token)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = token;
+  return true;
+}
+
+
+bool
+PXUring::timeout (const struct timeval &rel, uint64_t token)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  struct timespec *ts = ts_ + (sqe - static_cast<io_uring_sqe *> (sqes_));
+  ts->tv_sec = rel.tv_sec;
+  ts->tv_nsec = rel.tv_usec * 1000;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uintptr_t> (ts);
+  sqe->len = 1;
+  sqe->off = 0; // a pure timer, not counting completions
+  sqe->user_data = token;
+  return true;
+}
+
+
+bool
+PXUring::cancel (uint64_t token)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = token;
+  sqe->user_data = 0;
+  return true;
+}
+
+
+bool
+PXUring::cancel_timeout (uint64_t token)
+{
+  io_uring_sqe *sqe = static_cast<io_uring_sqe *> (get_sqe ());
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = token;
+  sqe->user_data = 0;
+  return true;
+}
+
+
+int
+PXUring::enter (unsigned wait_nr)
+{
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  int ret = (int)syscall (
+    __NR_io_uring_enter, fd_, pending_, wait_nr, flags, NULL, 0);
+  if (ret < 0)
+    return -1;
+  pending_ -= (unsigned)ret < pending_ ? (unsigned)ret : pending_;
+  return ret;
+}
+
+
+bool
+PXUring::next (completion_t *c)
+{
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n (cq_tail_, __ATOMIC_ACQUIRE))
+    return false;
+  const io_uring_cqe *cqe = static_cast<io_uring_cqe *> (cqes_) + (head & cq_mask_);
+  c->token = cqe->user_data;
+  c->res = cqe->res;
+  c->flags = cqe->flags;
+  __atomic_store_n (cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+bool
+PXUring::more (const completion_t &c) const
+{
+  return c.flags & IORING_CQE_F_MORE;
+}
+
+
+const char *
+PXUring::data (const completion_t &c) const
+{
+  if (!(c.flags & IORING_CQE_F_BUFFER))
+    return NULL;
+  return bufmem_ + (size_t)(c.flags >> IORING_CQE_BUFFER_SHIFT) * buf_size_;
+}
+
+
+void
+PXUring::recycle (const completion_t &c)
+{
+  if (c.flags & IORING_CQE_F_BUFFER)
+    add_buffer (c.flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+#else // !PX_HAVE_URING
+
+bool PXUring::setup (unsigned, unsigned, unsigned) { return false; }
+void PXUring::teardown () {}
+void PXUring::add_buffer (unsigned) {}
+void *PXUring::get_sqe () { return NULL; }
+bool PXUring::read (int, uint64_t, bool) { return false; }
+bool PXUring::write (int, const char *, size_t, uint64_t, bool) { return false; }
+bool PXUring::poll (int, uint64_t) { return false; }
+bool PXUring::timeout (const struct timeval &, uint64_t) { return false; }
+bool PXUring::cancel (uint64_t) { return false; }
+bool PXUring::cancel_timeout (uint64_t) { return false; }
+int PXUring::enter (unsigned) { errno = ENOSYS; return -1; }
+bool PXUring::next (completion_t *) { return false; }
+bool PXUring::more (const completion_t &) const { return false; }
+const char *PXUring::data (const completion_t &) const { return NULL; }
+void PXUring::recycle (const completion_t &) {}
+
+#endif
+
+} // namespace
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "PXWorkers.h"
+
+namespace ParEx
+{
+
+namespace
+{
+
+inline uint64_t lo (uint64_t r) { return r & 0xffffffffu; }
+inline uint64_t hi (uint64_t r) { return r >> 32; }
+
+} // anon namespace
+
+
+PXWorkers::PXWorkers (unsigned threads)
+  : parts_ (threads + 1), shares_ (new share_t[threads + 1]), threads_ (),
+    lock_ (), start_ (), done_ (), batch_ (0), busy_ (0), quit_ (false),
+    task_ (NULL)
+{
+  for (unsigned i = 1; i < parts_; ++i)
+    threads_.push_back (std::thread (&PXWorkers::thread_main, this, i));
+}
+
+
+PXWorkers::~PXWorkers ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    quit_ = true;
+  }
+  start_.notify_all ();
+  for (auto t = threads_.begin (); t != threads_.end (); ++t)
+    t->join ();
+}
+
+
+void
+PXWorkers::run (size_t n, const std::function<void (size_t)> &task)
+{
+  if (!n)
+    return;
+
+  for (unsigned i = 0; i < parts_; ++i)
+  {
+    uint64_t b = n * i / parts_, e = n * (i + 1) / parts_;
+    shares_[i].range.store ((e << 32) | b, std::memory_order_relaxed);
+  }
+  {
+    std::lock_guard<std::mutex> guard (lock_);
+    task_ = &task;
+    busy_ = static_cast<unsigned> (threads_.size ());
+    ++batch_;
+  }
+  start_.notify_all ();
+
+  work (0);
+
+  std::unique_lock<std::mutex> guard (lock_);
+  done_.wait (guard, [this] { return busy_ == 0; });
+  task_ = NULL;
+}
+
+
+void
+PXWorkers::thread_main (unsigned self)
+{
+  uint64_t seen = 0;
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> guard (lock_);
+      start_.wait (guard, [&] { return quit_ || batch_ != seen; });
+      if (quit_)
+        return;
+      seen = batch_;
+    }
+
+    work (self);
+
+    std::lock_guard<std::mutex> guard (lock_);
+    if (--busy_ == 0)
+      done_.notify_one ();
+  }
+}
+
+
+void
+PXWorkers::work (unsigned self)
+{
+  size_t task;
+  while (take (self, &task))
+    (*task_) (task);
+}
+
+
+bool
+PXWorkers::take (unsigned self, size_t *task)
+{
+  // own share first, from the front
+  std::atomic<uint64_t> &mine = shares_[self].range;
+  uint64_t r = mine.load (std::memory_order_relaxed);
+  while (lo (r) < hi (r))
+    if (mine.compare_exchange_weak (r, r + 1, std::memory_order_relaxed))
+    {
+      *task = static_cast<size_t> (lo (r));
+      return true;
+    }
+
+  // then one at a time from the back of everyone else's
+  for (unsigned i = 1; i < parts_; ++i)
+  {
+    std::atomic<uint64_t> &theirs = shares_[(self + i) % parts_].range;
+    r = theirs.load (std::memory_order_relaxed);
+    while (lo (r) < hi (r))
+      if (theirs.compare_exchange_weak (r, r - (uint64_t (1) << 32), std::memory_order_relaxed))
+      {
+        *task = static_cast<size_t> (hi (r) - 1);
+        return true;
+      }
+  }
+  return false;
+}
+
+} // namespace
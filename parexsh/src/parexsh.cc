@@ -4,8 +4,16 @@
 #include "PXFileIO.h"
 #include "PXSerialIO.h"
 #include "PXProcessIO.h"
+#include "PXSocketIO.h"
+#include "PXShmIO.h"
+#include "PXDemux.h"
+#include "PXFilter.h"
+#include "PXProgram.h"
 #include <cstdio>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
 #include <stdexcept>
 
 #include <algorithm>
@@ -16,6 +24,9 @@ std::shared_ptr<PXPrinter> printer (new PXInterleavedPrinter (stderr));
 PXDriver driver (printer);
 std::vector<std::shared_ptr<PXChannel> > channels;
 std::vector<channel_id_t> ids;
+std::vector<std::shared_ptr<PXIO> > ios;
+std::map<size_t, std::pair<std::shared_ptr<PXDemux>, bool> > demuxes;
+std::map<std::string, std::shared_ptr<PXProgram> > programs;
 
 speed_t convert_speed (int spd)
 {
@@ -50,17 +61,90 @@ void process_open_cmd (argv_t &argv)
         argv[5][1] == 'O' ? PARITY_ODD : argv[5][1] == 'E' ? PARITY_EVEN : NO_PARITY,
         argv[5][2] == '2'));
   }
+  else if (argv[1] == "tcp" && argv.size () == 5)
+  {
+    // tcp <channel> <host> <port>
+    io.reset (new PXSocketIO (argv[3], static_cast<uint16_t> (stoul (argv[4]))));
+  }
+  else if (argv[1] == "unix" && argv.size () == 4)
+  {
+    // unix <channel> <path>
+    io.reset (new PXSocketIO (argv[3]));
+  }
   else if (argv[1] == "process" && argv.size () > 3)
   {
     // process <channel> <cmd> [arg1 .. argN]
     argv_t proc (++ ++ ++argv.begin (), argv.end ()); // ignore first 3 args
     io.reset (new PXProcessIO (proc));
   }
+  else if (argv[1] == "shm" && argv.size () == 4)
+  {
+    // shm <channel> <envvar>
+    // for a simulator started after this, e.g. with "open process"
+    std::shared_ptr<PXShmIO> shm (new PXShmIO ());
+    setenv (argv[3].c_str (), shm->attach_spec ().c_str (), 1);
+    io = shm;
+  }
+  else if ((argv[1] == "pipe" || argv[1] == "pipes") && argv.size () > 4)
+  {
+    // pipe <channel> <logfile|-> <cmd> [arg1 .. argN]
+    // "pipes" keeps stderr apart, on a second channel <channel>.err
+    argv_t proc (argv.begin () + 4, argv.end ());
+    std::shared_ptr<PXPipeIO> pio (
+      new PXPipeIO (proc, argv[1] == "pipes", argv[3] == "-" ? "" : argv[3]));
+    io = pio;
+    if (pio->stderr_io ())
+    {
+      std::shared_ptr<PXChannel> ch (new PXChannel (io, argv[2]));
+      channels.push_back (ch);
+      ios.push_back (io);
+      ids.push_back (driver.add_channel (ch));
+      std::shared_ptr<PXChannel> err (
+        new PXChannel (pio->stderr_io (), argv[2] + ".err"));
+      channels.push_back (err);
+      ios.push_back (pio->stderr_io ());
+      ids.push_back (driver.add_channel (err));
+      std::cout << ids.size () -2 << " " << ids.size () -1 << std::endl;
+      return;
+    }
+  }
   else
     throw std::invalid_argument ("bad args");
 
   std::shared_ptr<PXChannel> ch (new PXChannel (io, argv[2]));
   channels.push_back (ch);
+  ios.push_back (io);
+  ids.push_back (driver.add_channel (ch));
+  std::cout << ids.size () -1 << std::endl;
+}
+
+void process_demux (argv_t &argv)
+{
+  // demux <channel> line
+  // demux <channel> frame <byte>
+  size_t n = stoul (argv.at (1));
+  std::shared_ptr<PXDemux> demux;
+  if (argv.size () == 3 && argv[2] == "line")
+    demux.reset (new PXDemux (ios.at (n)));
+  else if (argv.size () == 4 && argv[2] == "frame")
+    demux.reset (new PXDemux (ios.at (n), static_cast<char> (stoi (argv[3], 0, 0))));
+  else
+    throw std::invalid_argument ("bad args");
+  channels.at (n)->set_demux (demux);
+  demuxes[n] = std::make_pair (demux, argv[2] == "frame");
+}
+
+void process_route (argv_t &argv)
+{
+  // route <channel> <prefix-regex|byte> <name>
+  if (argv.size () != 4)
+    throw std::invalid_argument ("bad args");
+  auto &d = demuxes.at (stoul (argv[1]));
+  std::shared_ptr<PXChannel> ch = d.second ?
+    d.first->add_route (static_cast<char> (stoi (argv[2], 0, 0)), argv[3]) :
+    d.first->add_route (argv[2], argv[3]);
+  channels.push_back (ch);
+  ios.push_back (std::shared_ptr<PXIO> ());
   ids.push_back (driver.add_channel (ch));
   std::cout << ids.size () -1 << std::endl;
 }
@@ -74,6 +158,18 @@ void process_expect (argv_t &argv, bool parallel)
     argv[2], { stol (argv[3]), 0 }, parallel ? PXPARALLEL : PXSERIAL);
 }
 
+void process_idle_expect (argv_t &argv, bool parallel)
+{
+  // seridle/paridle <channel> <quiet_ms> <timeout>
+  if (argv.size () != 4)
+    throw std::invalid_argument ("bad args");
+
+  long ms = stol (argv[2]);
+  channels.at (stoul (argv[1]))->add_idle_expect (
+    { ms / 1000, (ms % 1000) * 1000 }, { stol (argv[3]), 0 },
+    parallel ? PXPARALLEL : PXSERIAL);
+}
+
 void process_clear_expect (argv_t &argv)
 {
   if (argv.size () != 2)
@@ -81,6 +177,27 @@ void process_clear_expect (argv_t &argv)
   channels.at (stoul (argv[1]))->clear_expects ();
 }
 
+void process_abort (argv_t &argv)
+{
+  // abort <channel|all> <expr>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  if (argv[1] == "all")
+    driver.add_abort (argv[2]);
+  else
+    channels.at (stoul (argv[1]))->add_abort (argv[2]);
+}
+
+void process_clear_abort (argv_t &argv)
+{
+  if (argv.size () != 2)
+    throw std::invalid_argument ("bad args");
+  if (argv[1] == "all")
+    driver.clear_aborts ();
+  else
+    channels.at (stoul (argv[1]))->clear_aborts ();
+}
+
 void process_wait (argv_t &argv)
 {
   if (argv.size () != 2)
@@ -96,6 +213,29 @@ void process_wait (argv_t &argv)
   }
 }
 
+void print_channels (const char *label, const PXDriver::channel_id_list_t &list)
+{
+  std::cout << label << ":";
+  for (auto i = list.begin (); i != list.end (); ++i)
+    std::cout << " " << (std::find (ids.begin (), ids.end (), *i) - ids.begin ());
+  std::cout << std::endl;
+}
+
+void process_wait_quorum (argv_t &argv)
+{
+  // waitn <group> <count|percent%>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  size_t n = stoul (argv[2]);
+  if (argv[2].back () == '%')
+    n = (driver.group_size (argv[1]) * n + 99) / 100;
+  PXDriver::quorum_t q = driver.wait_for_group (argv[1], n);
+  print_channels ("matched", q.matched);
+  print_channels ("pending", q.pending);
+  if (!q.reached)
+    throw PXDriver::TIMEOUT ();
+}
+
 void process_write (argv_t &argv)
 {
   if (argv.size () == 3)
@@ -104,6 +244,249 @@ void process_write (argv_t &argv)
     throw std::invalid_argument ("bad args");
 }
 
+void process_pace (argv_t &argv)
+{
+  // pace <channel> <char_delay_us> [line_delay_us]
+  if (argv.size () != 3 && argv.size () != 4)
+    throw std::invalid_argument ("bad args");
+
+  long cus = stol (argv[2]);
+  long lus = argv.size () == 4 ? stol (argv[3]) : 0;
+  channels.at (stoul (argv[1]))->set_pacing (
+    { cus / 1000000, cus % 1000000 }, { lus / 1000000, lus % 1000000 });
+}
+
+void process_pacerate (argv_t &argv)
+{
+  // pacerate <channel> <bytes_per_sec>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  channels.at (stoul (argv[1]))->set_pacing_rate (
+    static_cast<unsigned> (stoul (argv[2])));
+}
+
+void process_priority (argv_t &argv)
+{
+  // prio <channel> <priority>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  channels.at (stoul (argv[1]))->set_priority (stoi (argv[2]));
+}
+
+void process_capture (argv_t &argv)
+{
+  // capture <channel> <name>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  std::shared_ptr<PXChannel> ch = channels.at (stoul (argv[1]));
+  size_t off, len;
+  if (!ch->capture (argv[2], &off, &len))
+    throw std::invalid_argument ("no such capture");
+  std::cout << ch->last_match ().substr (off, len) << std::endl;
+}
+
+void process_line_mode (argv_t &argv)
+{
+  // linemode <channel> on|off [tail_ms]
+  if ((argv.size () != 3 && argv.size () != 4) ||
+      (argv[2] != "on" && argv[2] != "off"))
+    throw std::invalid_argument ("bad args");
+  long ms = argv.size () == 4 ? stol (argv[3]) : 100;
+  channels.at (stoul (argv[1]))->set_line_mode (
+    argv[2] == "on", { ms / 1000, (ms % 1000) * 1000 });
+}
+
+void process_filter (argv_t &argv)
+{
+  // filter <channel> ansi|none
+  if (argv.size () != 3 || (argv[2] != "ansi" && argv[2] != "none"))
+    throw std::invalid_argument ("bad args");
+  std::shared_ptr<PXFilter> filter;
+  if (argv[2] == "ansi")
+    filter.reset (new PXAnsiFilter ());
+  channels.at (stoul (argv[1]))->set_filter (filter);
+}
+
+void process_budget (argv_t &argv)
+{
+  // budget <channel> <bytes>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  channels.at (stoul (argv[1]))->set_read_budget (stoul (argv[2]));
+}
+
+void process_drain (argv_t &argv)
+{
+  if (argv.size () != 1)
+    throw std::invalid_argument ("bad args");
+  driver.drain_writes ();
+}
+
+void process_events (argv_t &argv)
+{
+  // events [timeout_ms], without a timeout runs until nothing is pending
+  if (argv.size () > 2)
+    throw std::invalid_argument ("bad args");
+  int n;
+  if (argv.size () == 2)
+  {
+    long ms = stol (argv[1]);
+    n = driver.run_once ({ ms / 1000, (ms % 1000) * 1000 });
+  }
+  else
+    n = driver.run ();
+  if (n < 0)
+    throw std::runtime_error ("event loop failed");
+  std::cout << n << std::endl;
+}
+
+void process_busypoll (argv_t &argv)
+{
+  // busypoll <spin_us> [cpu]
+  if (argv.size () != 2 && argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  long us = stol (argv[1]);
+  driver.set_busy_poll ({ us / 1000000, us % 1000000 });
+  if (argv.size () == 3 && PXDriver::pin_to_cpu (stoi (argv[2])) < 0)
+    throw std::runtime_error ("pinning failed");
+}
+
+void process_uring (argv_t &argv)
+{
+  if (argv.size () != 1)
+    throw std::invalid_argument ("bad args");
+  if (!driver.use_uring ())
+    throw std::runtime_error ("io_uring not available");
+}
+
+void process_workers (argv_t &argv)
+{
+  // workers <threads> [min_batch], 0 threads matches on the driver thread
+  if (argv.size () != 2 && argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  unsigned threads = static_cast<unsigned> (stoul (argv[1]));
+  if (argv.size () == 3)
+    driver.set_match_workers (threads, stoul (argv[2]));
+  else
+    driver.set_match_workers (threads);
+}
+
+void print_histogram (const char *label, const PXHistogram &h)
+{
+  std::cout << label << ": n=" << h.count () << " mean=" << h.mean_us ()
+    << "us p50=" << h.percentile_us (50) << "us p99=" << h.percentile_us (99)
+    << "us max=" << h.max_us () << "us" << std::endl;
+}
+
+void process_latency (argv_t &argv)
+{
+  // latency [reset]
+  if (argv.size () > 2)
+    throw std::invalid_argument ("bad args");
+  print_histogram ("match", driver.match_latency ());
+  print_histogram ("wake", driver.wake_latency ());
+  if (argv.size () == 2)
+    driver.reset_latency ();
+}
+
+void process_reopen (argv_t &argv)
+{
+  if (argv.size () != 2)
+    throw std::invalid_argument ("bad args");
+  channels.at (stoul (argv[1]))->reopen ();
+}
+
+// Accepts single channel numbers as well as inclusive ranges, e.g. "4-7"
+std::vector<size_t> parse_channels (argv_t::const_iterator b, argv_t::const_iterator e)
+{
+  std::vector<size_t> chans;
+  for (; b != e; ++b)
+  {
+    std::string::size_type dash = b->find ('-');
+    size_t first = stoul (b->substr (0, dash));
+    size_t last = dash == std::string::npos ? first : stoul (b->substr (dash +1));
+    for (size_t n = first; n <= last; ++n)
+      chans.push_back (n);
+  }
+  return chans;
+}
+
+void process_group (argv_t &argv)
+{
+  // group <name> <channel|first-last> [...]
+  if (argv.size () < 3)
+    throw std::invalid_argument ("bad args");
+  std::vector<size_t> chans = parse_channels (argv.begin () +2, argv.end ());
+  for (auto i = chans.begin (); i != chans.end (); ++i)
+    driver.group_add (argv[1], ids.at (*i));
+}
+
+void process_ungroup (argv_t &argv)
+{
+  // ungroup <name> [<channel|first-last> ...]
+  if (argv.size () < 2)
+    throw std::invalid_argument ("bad args");
+  if (argv.size () == 2)
+    driver.group_clear (argv[1]);
+  std::vector<size_t> chans = parse_channels (argv.begin () +2, argv.end ());
+  for (auto i = chans.begin (); i != chans.end (); ++i)
+    driver.group_remove (argv[1], ids.at (*i));
+}
+
+void process_close (argv_t &argv)
+{
+  // close <channel|first-last> [...]
+  if (argv.size () < 2)
+    throw std::invalid_argument ("bad args");
+  std::vector<size_t> chans = parse_channels (argv.begin () +1, argv.end ());
+  for (auto i = chans.begin (); i != chans.end (); ++i)
+    driver.remove_channel (ids.at (*i));
+}
+
+void process_broadcast_write (argv_t &argv)
+{
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  driver.broadcast_write (argv[1], argv[2]);
+}
+
+void process_broadcast_expect (argv_t &argv, bool parallel)
+{
+  if (argv.size () != 4)
+    throw std::invalid_argument ("bad args");
+  driver.broadcast_expect (
+    argv[1], argv[2], { stol (argv[3]), 0 }, parallel ? PXPARALLEL : PXSERIAL);
+}
+
+void process_load (argv_t &argv)
+{
+  // load <name> <file>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  std::ifstream in (argv[2]);
+  if (!in)
+    throw std::invalid_argument ("no such file");
+  std::ostringstream text;
+  text << in.rdbuf ();
+  programs[argv[1]].reset (new PXProgram (text.str ()));
+}
+
+void process_run (argv_t &argv)
+{
+  // run <channel> <program>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  channels.at (stoul (argv[1]))->run (programs.at (argv[2]));
+}
+
+void process_broadcast_run (argv_t &argv)
+{
+  // brun <group> <program>
+  if (argv.size () != 3)
+    throw std::invalid_argument ("bad args");
+  driver.broadcast_run (argv[1], programs.at (argv[2]));
+}
+
 char unescape (char c)
 {
   switch (c)
@@ -189,12 +572,72 @@ int main (int argc, char *argv[])
         process_expect (cmd_argv, false);
       else if (line.find ("parexp") == 0)
         process_expect (cmd_argv, true);
+      else if (line.find ("seridle") == 0)
+        process_idle_expect (cmd_argv, false);
+      else if (line.find ("paridle") == 0)
+        process_idle_expect (cmd_argv, true);
       else if (line.find ("clearexp") == 0)
         process_clear_expect (cmd_argv);
+      else if (line.find ("abort") == 0)
+        process_abort (cmd_argv);
+      else if (line.find ("clearabort") == 0)
+        process_clear_abort (cmd_argv);
+      else if (line.find ("waitn") == 0)
+        process_wait_quorum (cmd_argv);
       else if (line.find ("wait") == 0)
         process_wait (cmd_argv);
       else if (line.find ("write") == 0)
         process_write (cmd_argv);
+      else if (line.find ("group") == 0)
+        process_group (cmd_argv);
+      else if (line.find ("ungroup") == 0)
+        process_ungroup (cmd_argv);
+      else if (line.find ("bwrite") == 0)
+        process_broadcast_write (cmd_argv);
+      else if (line.find ("bserexp") == 0)
+        process_broadcast_expect (cmd_argv, false);
+      else if (line.find ("bparexp") == 0)
+        process_broadcast_expect (cmd_argv, true);
+      else if (line.find ("pacerate") == 0)
+        process_pacerate (cmd_argv);
+      else if (line.find ("pace") == 0)
+        process_pace (cmd_argv);
+      else if (line.find ("capture") == 0)
+        process_capture (cmd_argv);
+      else if (line.find ("linemode") == 0)
+        process_line_mode (cmd_argv);
+      else if (line.find ("filter") == 0)
+        process_filter (cmd_argv);
+      else if (line.find ("demux") == 0)
+        process_demux (cmd_argv);
+      else if (line.find ("route") == 0)
+        process_route (cmd_argv);
+      else if (line.find ("prio") == 0)
+        process_priority (cmd_argv);
+      else if (line.find ("budget") == 0)
+        process_budget (cmd_argv);
+      else if (line.find ("drain") == 0)
+        process_drain (cmd_argv);
+      else if (line.find ("events") == 0)
+        process_events (cmd_argv);
+      else if (line.find ("busypoll") == 0)
+        process_busypoll (cmd_argv);
+      else if (line.find ("uring") == 0)
+        process_uring (cmd_argv);
+      else if (line.find ("workers") == 0)
+        process_workers (cmd_argv);
+      else if (line.find ("latency") == 0)
+        process_latency (cmd_argv);
+      else if (line.find ("reopen") == 0)
+        process_reopen (cmd_argv);
+      else if (line.find ("close") == 0)
+        process_close (cmd_argv);
+      else if (line.find ("load") == 0)
+        process_load (cmd_argv);
+      else if (line.find ("run") == 0)
+        process_run (cmd_argv);
+      else if (line.find ("brun") == 0)
+        process_broadcast_run (cmd_argv);
       else if (line.find ("exit") == 0)
         break;
       else
@@ -205,6 +648,12 @@ int main (int argc, char *argv[])
     {
       std::cout << "timeout\n" << std::flush;
     }
+    catch (PXDriver::ABORTED &a)
+    {
+      std::cout << "aborted "
+        << (std::find (ids.begin (), ids.end (), a.chan_id) - ids.begin ())
+        << "\n" << std::flush;
+    }
     catch (UNKNOWN&)
     {
       std::cout << "unknown\n" << std::flush;
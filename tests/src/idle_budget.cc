@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Checks the memory budget documented at PXDriver::add_channel (): an idle
+// channel costs under 600 bytes of heap, counting its share of the driver's
+// and the printer's tables but not its device. Each channel has a pipe of
+// its own, and the budget has to hold once the driver has polled them all.
+
+#include "PXDriver.h"
+#include "PXChannel.h"
+#include "PXInterleavedPrinter.h"
+#include "PXIO.h"
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <cstdio>
+#include <vector>
+
+using namespace ParEx;
+
+namespace
+{
+
+const size_t max_channels = 10000;
+const size_t budget = 600;
+const timeval_t wait = { 0, 100000 };
+
+// The read end of a pipe, whose write end is kept open so the channel
+// stays idle rather than seeing EOF
+class PipeIO : public PXIO
+{
+  public:
+    explicit PipeIO (int fd) : PXIO (fd) {}
+
+    virtual void reopen () {}
+};
+
+} // namespace
+
+
+int
+main ()
+{
+  // two fds per channel, and a few for the driver and stdio
+  struct rlimit rl;
+  getrlimit (RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit (RLIMIT_NOFILE, &rl);
+  size_t channels = max_channels;
+  if (rl.rlim_cur != RLIM_INFINITY && (rl.rlim_cur - 64) / 2 < channels)
+    channels = (rl.rlim_cur - 64) / 2;
+
+  // the devices are made up front, so only the channels are counted
+  std::vector<std::shared_ptr<PXIO> > ios;
+  std::vector<int> writers;
+  for (size_t i = 0; i < channels; ++i)
+  {
+    int fds[2];
+    if (pipe2 (fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+      perror ("idle_budget: pipe2");
+      return 1;
+    }
+    ios.push_back (std::shared_ptr<PXIO> (new PipeIO (fds[0])));
+    writers.push_back (fds[1]);
+  }
+
+  std::shared_ptr<PXPrinter> printer (
+    new PXInterleavedPrinter (fopen ("/dev/null", "w")));
+  PXDriver driver (printer);
+  std::vector<std::shared_ptr<PXChannel> > chans;
+  chans.reserve (channels);
+  size_t before = mallinfo2 ().uordblks;
+  for (size_t i = 0; i < channels; ++i)
+  {
+    char name[16];
+    snprintf (name, sizeof (name), "ch%zu", i);
+    chans.push_back (std::shared_ptr<PXChannel> (new PXChannel (ios[i], name)));
+    driver.add_channel (chans.back ());
+  }
+
+  // nothing arrives, so this times out after polling every channel
+  chans.back ()->add_expect ("never", wait, PXSERIAL);
+  try {
+    driver.wait_for_any ();
+    fprintf (stderr, "idle_budget: matched on an idle channel\n");
+    return 1;
+  }
+  catch (const PXDriver::TIMEOUT &) {}
+  size_t each = (mallinfo2 ().uordblks - before) / channels;
+
+  for (size_t i = 0; i < writers.size (); ++i)
+    close (writers[i]);
+  printf ("idle_budget: %zu bytes per idle channel, of %zu, over %zu pipes\n",
+    each, budget, channels);
+  return each < budget ? 0 : 1;
+}
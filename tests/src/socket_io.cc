@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Connects, reads, writes and reopens a PXSocketIO channel over TCP, by
+// name so that every address the name has gets tried, and over a
+// Unix-domain socket, each against a listener in a child process.
+
+#include "PXDriver.h"
+#include "PXChannel.h"
+#include "PXInterleavedPrinter.h"
+#include "PXSocketIO.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+
+using namespace ParEx;
+
+namespace
+{
+
+const timeval_t timeout = { 5, 0 };
+
+
+// Until the peer closes, or the text turns up
+bool
+read_until (int fd, const char *text)
+{
+  std::string got;
+  char buf[256];
+  ssize_t len;
+  while (got.find (text) == std::string::npos &&
+         (len = read (fd, buf, sizeof (buf))) > 0)
+    got.append (buf, (size_t)len);
+  return got.find (text) != std::string::npos;
+}
+
+
+bool
+send_all (int fd, const char *text)
+{
+  return write (fd, text, strlen (text)) == (ssize_t)strlen (text);
+}
+
+
+// The other end: greets, answers a ping, hangs up, and greets the
+// reconnect. Exits with 0 if the channel said everything it should have.
+void
+serve (int lfd)
+{
+  int fd = accept (lfd, NULL, NULL);
+  bool ok = fd >= 0 && send_all (fd, "hello\n") && read_until (fd, "ping\n") &&
+    send_all (fd, "pong\n");
+  close (fd);
+
+  fd = accept (lfd, NULL, NULL);
+  ok = ok && fd >= 0 && send_all (fd, "again\n") && read_until (fd, "bye\n");
+  close (fd);
+  _exit (ok ? 0 : 1);
+}
+
+
+void
+expect (PXDriver &driver, std::shared_ptr<PXChannel> chan, const char *expr)
+{
+  chan->add_expect (expr, timeout, PXSERIAL);
+  driver.wait_for_one (chan->id ());
+}
+
+
+bool
+check (const char *what, int lfd, std::shared_ptr<PXIO> io)
+{
+  pid_t pid = fork ();
+  if (pid == 0)
+    serve (lfd);
+  close (lfd);
+  if (pid < 0)
+    return false;
+
+  bool ok = true;
+  try {
+    std::shared_ptr<PXPrinter> printer (
+      new PXInterleavedPrinter (fopen ("/dev/null", "w")));
+    PXDriver driver (printer);
+    std::shared_ptr<PXChannel> chan (new PXChannel (io, what));
+    driver.add_channel (chan);
+
+    expect (driver, chan, "hello\n");
+    chan->write ("ping\n");
+    expect (driver, chan, "pong\n");
+    chan->reopen ();
+    expect (driver, chan, "again\n");
+    chan->write ("bye\n");
+    driver.drain_writes ();
+  }
+  catch (...) {
+    ok = false;
+  }
+
+  int status = 1;
+  if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) ||
+      WEXITSTATUS (status) != 0)
+    ok = false;
+  printf ("socket_io: %s %s\n", what, ok ? "ok" : "failed");
+  return ok;
+}
+
+
+bool
+check_tcp ()
+{
+  int lfd = socket (AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (lfd < 0 ||
+      bind (lfd, reinterpret_cast<struct sockaddr *> (&sin), sizeof (sin)) < 0 ||
+      listen (lfd, 1) < 0 ||
+      getsockname (lfd, reinterpret_cast<struct sockaddr *> (&sin), &len) < 0)
+  {
+    perror ("socket_io: tcp listener");
+    return false;
+  }
+  return check ("tcp", lfd,
+    std::shared_ptr<PXIO> (new PXSocketIO ("localhost", ntohs (sin.sin_port))));
+}
+
+
+bool
+check_unix ()
+{
+  char dir[] = "/tmp/socket_ioXXXXXX";
+  if (!mkdtemp (dir))
+    return false;
+  std::string path = std::string (dir) + "/sock";
+
+  int lfd = socket (AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un sun;
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path.c_str ());
+  bool ok = lfd >= 0 &&
+    bind (lfd, reinterpret_cast<struct sockaddr *> (&sun), sizeof (sun)) == 0 &&
+    listen (lfd, 1) == 0;
+  if (!ok)
+    perror ("socket_io: unix listener");
+  else
+    ok = check ("unix", lfd, std::shared_ptr<PXIO> (new PXSocketIO (path)));
+  unlink (path.c_str ());
+  rmdir (dir);
+  return ok;
+}
+
+} // namespace
+
+
+int
+main ()
+{
+  bool tcp = check_tcp ();
+  bool local = check_unix ();
+  return tcp && local ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2012 Johny Mattsson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holders nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Checks that, once warmed up, the read, match and print loop of a channel
+// matching a steady stream of output doesn't touch the heap. Every
+// operator new past the warm-up counts against it.
+
+#include "PXDriver.h"
+#include "PXChannel.h"
+#include "PXInterleavedPrinter.h"
+#include "PXFileIO.h"
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <new>
+
+using namespace ParEx;
+
+namespace
+{
+
+bool counting = false;
+unsigned long allocs = 0;
+
+const int warmup = 200;
+const int iterations = 2000;
+
+} // namespace
+
+
+void *
+operator new (size_t size)
+{
+  if (counting)
+    ++allocs;
+  void *p = malloc (size ? size : 1);
+  if (!p)
+    throw std::bad_alloc ();
+  return p;
+}
+
+
+void
+operator delete (void *p) noexcept
+{
+  free (p);
+}
+
+
+void
+operator delete (void *p, size_t) noexcept
+{
+  free (p);
+}
+
+
+int
+main ()
+{
+  // a file rather than a process, so reads come in the same sizes each
+  // time and the buffers reach their largest during the warm-up
+  char path[] = "/tmp/steady_allocXXXXXX";
+  int fd = mkstemp (path);
+  FILE *log = fd >= 0 ? fdopen (fd, "w") : NULL;
+  if (!log)
+    return 1;
+  for (int i = 0; i < iterations; ++i)
+    fprintf (log, "noise noise %06d\ntick %06d\n", i, i);
+  fclose (log);
+
+  std::shared_ptr<PXPrinter> printer (
+    new PXInterleavedPrinter (fopen ("/dev/null", "w")));
+  PXDriver driver (printer);
+  std::shared_ptr<PXChannel> chan (
+    new PXChannel (std::shared_ptr<PXIO> (new PXFileIO (path)), "ticker"));
+  driver.add_channel (chan);
+  unlink (path);
+
+  std::shared_ptr<PXPattern> pattern (PXPattern::intern ("tick [0-9]+\n"));
+  timeval_t timeout = { 5, 0 };
+  for (int i = 0; i < iterations; ++i)
+  {
+    counting = i >= warmup;
+    timeval_t expiry;
+    gettimeofday (&expiry, NULL);
+    expiry += timeout;
+    chan->add_expect (pattern, timeout, expiry, PXSERIAL);
+    driver.wait_for_any ();
+  }
+  counting = false;
+
+  printf ("steady_alloc: %lu allocations in %d matches\n",
+    allocs, iterations - warmup);
+  return allocs ? 1 : 0;
+}